@@ -0,0 +1,36 @@
+#!/bin/sh
+# Builds clox with threaded dispatch and with SWITCH_DISPATCH, runs every
+# benchmark with both and prints the best time of several runs for each.
+# Each benchmark prints its elapsed seconds last.
+#
+# usage: bench/run.sh [runs] [extra compiler flags...]
+
+set -e
+cd "$(dirname "$0")"
+runs=${1:-5}
+[ $# -gt 0 ] && shift
+cc=${CC:-cc}
+build=$(mktemp -d)
+trap 'rm -rf "$build"' EXIT
+
+$cc -std=c11 -O2 "$@" ../*.c -o "$build/threaded" -lm -lpthread
+$cc -std=c11 -O2 -DSWITCH_DISPATCH "$@" ../*.c -o "$build/switch" -lm -lpthread
+
+best()
+{
+    i=0
+    while [ $i -lt "$runs" ]
+    do
+        "$1" "$2" | tail -n 1
+        i=$((i + 1))
+    done | sort -g | head -n 1
+}
+
+printf '%-12s %10s %10s %8s\n' script switch threaded speedup
+for script in *.lox
+do
+    switch=$(best "$build/switch" "$script")
+    threaded=$(best "$build/threaded" "$script")
+    printf '%-12s %10.3f %10.3f %7.2fx\n' "${script%.lox}" "$switch" "$threaded" \
+        "$(echo "$switch $threaded" | awk '{ print $1 / $2 }')"
+done
@@ -14,6 +14,13 @@ static void grow(Chunk* chunk)
     chunk->lines = grow_array_int(chunk->lines, old, new);
 }
 
+static void grow_caches(Chunk* chunk)
+{
+    int old = chunk->cache_capacity;
+    chunk->cache_capacity = grow_capacity(old);
+    chunk->caches = grow_array_cache(chunk->caches, old, chunk->cache_capacity);
+}
+
 void init_chunk(Chunk* chunk)
 {
     chunk->count = 0;
@@ -21,6 +28,9 @@ void init_chunk(Chunk* chunk)
     chunk->code = NULL;
     chunk->lines = NULL;
     init_value_array(&chunk->constants);
+    chunk->cache_count = 0;
+    chunk->cache_capacity = 0;
+    chunk->caches = NULL;
 }
 
 void free_chunk(Chunk* chunk)
@@ -28,6 +38,7 @@ void free_chunk(Chunk* chunk)
     free_array_uint8_t(chunk->code, chunk->capacity);
     free_array_int(chunk->lines, chunk->capacity);
     free_value_arrray(&chunk->constants);
+    free_array_cache(chunk->caches, chunk->cache_capacity);
     init_chunk(chunk);
 }
 
@@ -50,3 +61,17 @@ int add_constant(Chunk* chunk, Value value)
     pop();
     return chunk->constants.count - 1;
 }
+
+int add_cache(Chunk* chunk)
+{
+    if (chunk->cache_capacity < chunk->cache_count + 1)
+    {
+        grow_caches(chunk);
+    }
+    Inline_cache* cache = &chunk->caches[chunk->cache_count];
+    cache->shape = NULL;
+    cache->slot = 0;
+    cache->method = NULL;
+    cache->transition = NULL;
+    return chunk->cache_count++;
+}
@@ -38,14 +38,60 @@ typedef enum
     op_jump,
     op_loop,
     op_call,
+    op_tail_call,
     op_invoke,
+    op_tail_invoke,
     op_super_invoke,
+    op_tail_super_invoke,
     op_closure,
     op_return,
     op_class,
-    op_inherit
+    op_inherit,
+    // Register forms, which the compiler emits for operators whose operands
+    // are both locals, or a local and a constant. They take the operands
+    // from the frame's slots and the constant table and push the result.
+    // pop_local pops the top into a local, for assignment statements.
+    op_equal_locals,
+    op_greater_locals,
+    op_less_locals,
+    op_add_locals,
+    op_subtract_locals,
+    op_multiply_locals,
+    op_divide_locals,
+    op_equal_constant,
+    op_greater_constant,
+    op_less_constant,
+    op_add_constant,
+    op_subtract_constant,
+    op_multiply_constant,
+    op_divide_constant,
+    op_pop_local,
+    // Quickened forms. The compiler never emits these; the VM rewrites a
+    // generic instruction into one after seeing number operands and back
+    // again on a type miss.
+    op_add_number,
+    op_subtract_number,
+    op_multiply_number,
+    op_divide_number,
+    op_greater_number,
+    op_less_number
 } Op_code;
 
+typedef struct Closure Closure;
+typedef struct Shape Shape;
+
+// Per-instruction cache for property reads, writes and invocations, keyed
+// on the receiver's shape. For a field, slot is where it lives; for a
+// method, method is the resolved closure. A write that adds a field also
+// records the shape the instance transitions to.
+typedef struct
+{
+    Shape* shape;
+    int slot;
+    Closure* method;
+    Shape* transition;
+} Inline_cache;
+
 typedef struct
 {
     int count;
@@ -53,11 +99,15 @@ typedef struct
     uint8_t* code;
     int* lines;
     Value_array constants;
+    int cache_count;
+    int cache_capacity;
+    Inline_cache* caches;
 } Chunk;
 
 void init_chunk(Chunk* chunk);
 void free_chunk(Chunk* chunk);
 void write_chunk(Chunk* chunk, uint8_t byte, int line);
 int add_constant(Chunk* chunk, Value value);
+int add_cache(Chunk* chunk);
 
 #endif
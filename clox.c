@@ -2,6 +2,7 @@
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "vm.h"
 
@@ -73,24 +74,123 @@ static void run_file(const char* path)
     }
 }
 
+// Reads "name=number" into number. Returns false if argument is not that.
+static bool read_number(const char* argument, const char* name, double* number)
+{
+    size_t length = strlen(name);
+    bool result = false;
+    if (strncmp(argument, name, length) == 0 && argument[length] == '=')
+    {
+        const char* start = argument + length + 1;
+        char* end;
+        *number = strtod(start, &end);
+        result = end != start && *end == '\0' && *number >= 0;
+    }
+    return result;
+}
+
+// Opens the file a --gc-log option names, or returns false if the option
+// is something else.
+static bool open_log(const char* argument, GC_settings* settings)
+{
+    const char* name = "--gc-log=";
+    bool result = false;
+    if (strncmp(argument, name, strlen(name)) == 0)
+    {
+        const char* path = argument + strlen(name);
+        settings->log = fopen(path, "w");
+        if (settings->log == NULL)
+        {
+            fprintf(stderr, "Could not open file \"%s\".\n", path);
+            exit(74);
+        }
+        settings->census = true;
+        result = true;
+    }
+    return result;
+}
+
+static bool parse_option(const char* argument, GC_settings* settings)
+{
+    const double megabyte = 1024.0 * 1024.0;
+    double number;
+    bool result = true;
+    if (read_number(argument, "--gc-heap", &number))
+    {
+        settings->initial_heap = (size_t)(number * megabyte);
+    }
+    else if (read_number(argument, "--gc-growth", &number))
+    {
+        settings->heap_growth = (size_t)number;
+    }
+    else if (read_number(argument, "--gc-limit", &number))
+    {
+        settings->memory_limit = (size_t)(number * megabyte);
+    }
+    else if (read_number(argument, "--gc-pause", &number))
+    {
+        settings->pause_target = number / 1000;
+    }
+    else if (read_number(argument, "--gc-budget", &number))
+    {
+        settings->step_budget = (size_t)number;
+    }
+    else if (read_number(argument, "--gc-workers", &number))
+    {
+        settings->workers = (int)number;
+    }
+    else
+    {
+        result = open_log(argument, settings);
+    }
+    return result;
+}
+
 int main(int argc, char* argv[])
 {
     init_VM();
 
-    if (argc == 1)
+    GC_settings settings;
+    default_GC_settings(&settings);
+    const char* path = NULL;
+    bool valid = true;
+    for (int i = 1; i < argc && valid; i++)
     {
-        repl();
+        if (strncmp(argv[i], "--", 2) == 0)
+        {
+            valid = parse_option(argv[i], &settings);
+        }
+        else if (path == NULL)
+        {
+            path = argv[i];
+        }
+        else
+        {
+            valid = false;
+        }
     }
-    else if (argc == 2)
+    if (!valid)
     {
-        run_file(argv[1]);
+        fprintf(stderr, "usage: clox [--gc-heap=MB] [--gc-growth=PERCENT] [--gc-limit=MB]\n"
+                        "            [--gc-pause=MS] [--gc-budget=OBJECTS] [--gc-workers=N]\n"
+                        "            [--gc-log=PATH] [path]\n");
+        exit(64);
+    }
+    configure_GC(&settings);
+
+    if (path == NULL)
+    {
+        repl();
     }
     else
     {
-        fprintf(stderr, "usage: clox [path]\n");
-        exit(64);
+        run_file(path);
     }
 
     free_VM();
+    if (settings.log != NULL)
+    {
+        fclose(settings.log);
+    }
     return 0;
 }
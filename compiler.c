@@ -10,6 +10,7 @@
 #include "object.h"
 #include "scanner.h"
 #include "value.h"
+#include "vm.h"
 
 #ifdef DEBUG_PRINT_CODE
 #include "debug.h"
@@ -75,6 +76,10 @@ typedef struct Compiler
     int local_count;
     Upvalue_node upvalues[variables_max];
     int scope_depth;
+    int last_call;
+    int last_call_end;
+    int last_operand;
+    int last_target;
 } Compiler;
 
 typedef struct Class_compiler
@@ -135,11 +140,16 @@ static void init_compiler(Compiler* compiler, Function_type type)
     compiler->type = type;
     compiler->local_count = 0;
     compiler->scope_depth = 0;
+    compiler->last_call = -1;
+    compiler->last_call_end = -1;
+    compiler->last_operand = -1;
+    compiler->last_target = -1;
     compiler->function = new_function();
     current = compiler;
     if (type != type_script)
     {
         current->function->name = copy_string(parser.previous.start, parser.previous.length);
+        write_barrier_object((Object*)current->function, (Object*)current->function->name);
     }
 
     Local* local = &current->locals[current->local_count++];
@@ -207,6 +217,7 @@ static uint8_t make_constant(Value value)
 {
     Chunk* chunk = current_chunk();
     int constant = add_constant(chunk, value);
+    write_barrier((Object*)current->function, value);
     uint8_t result;
     if (constant > UINT8_MAX)
     {
@@ -232,8 +243,27 @@ static void emit_bytes(uint8_t a, uint8_t b)
     emit_byte(b);
 }
 
+static void emit_cache()
+{
+    int cache = add_cache(current_chunk());
+    if (cache > UINT16_MAX)
+    {
+        error("Too many property accesses in one chunk.");
+    }
+    emit_byte((cache >> 8) & 0xff);
+    emit_byte(cache & 0xff);
+}
+
+static void emit_global(uint8_t instruction, int slot)
+{
+    emit_byte(instruction);
+    emit_byte((slot >> 8) & 0xff);
+    emit_byte(slot & 0xff);
+}
+
 static void emit_constant(Value value)
 {
+    current->last_operand = current_chunk()->count;
     emit_bytes(op_constant, make_constant(value));
 }
 
@@ -272,6 +302,7 @@ static void emit_loop(int loop_start)
 
 static void patch_jump(int offset)
 {
+    current->last_target = current_chunk()->count;
     int jump = current_chunk()->count - offset - 2;
     if (jump > UINT16_MAX)
     {
@@ -281,6 +312,82 @@ static void patch_jump(int offset)
     current_chunk()->code[offset + 1] = jump & 0xff;
 }
 
+// Returns where the local read that ends the code so far starts, or -1 if
+// the code doesn't end in one. An operator whose left operand is that read
+// alone may fuse with it; no jump may land after its start.
+static int local_operand()
+{
+    int count = current_chunk()->count;
+    int result = -1;
+    if (current->last_operand == count - 2 && current_chunk()->code[count - 2] == op_get_local
+        && current->last_target <= count - 2)
+    {
+        result = count - 2;
+    }
+    return result;
+}
+
+// Emits a binary operator, as a register instruction when its left operand
+// is the local read at left and its right one the single local read or
+// constant that follows.
+static void emit_operator(int left, uint8_t instruction, uint8_t locals, uint8_t constant)
+{
+    Chunk* chunk = current_chunk();
+    int right = left + 2;
+    uint8_t fused = instruction;
+    if (left != -1 && current->last_operand == right && chunk->count == right + 2
+        && current->last_target <= left)
+    {
+        if (chunk->code[right] == op_get_local)
+        {
+            fused = locals;
+        }
+        else if (chunk->code[right] == op_constant)
+        {
+            fused = constant;
+        }
+    }
+    if (fused != instruction)
+    {
+        uint8_t a = chunk->code[left + 1];
+        uint8_t b = chunk->code[right + 1];
+        chunk->count = left;
+        current->last_operand = -1;
+        emit_byte(fused);
+        emit_bytes(a, b);
+    }
+    else
+    {
+        emit_byte(instruction);
+    }
+}
+
+// Discards the value of an expression statement. One that ends by storing
+// to a local stores and pops at once.
+static void emit_pop()
+{
+    Chunk* chunk = current_chunk();
+    int store = chunk->count - 2;
+    if (current->last_operand == store && chunk->code[store] == op_set_local
+        && current->last_target <= store)
+    {
+        chunk->code[store] = op_pop_local;
+        current->last_operand = -1;
+    }
+    else
+    {
+        emit_byte(op_pop);
+    }
+}
+
+// Notes the call emitted from start on, which becomes a tail call if a
+// return follows it directly.
+static void mark_call(int start)
+{
+    current->last_call = start;
+    current->last_call_end = current_chunk()->count;
+}
+
 static Function* end_compiler()
 {
     emit_return();
@@ -338,6 +445,18 @@ static uint8_t identifier_constant(Token* name)
     return make_constant(value);
 }
 
+static int identifier_global(Token* name)
+{
+    String* string = copy_string(name->start, name->length);
+    int slot = resolve_global(string);
+    if (slot > UINT16_MAX)
+    {
+        error("Too many global variables.");
+        slot = 0;
+    }
+    return slot;
+}
+
 static void add_local(Token name)
 {
     if (current->local_count < variables_max)
@@ -383,11 +502,11 @@ static void declare_variable()
     }
 }
 
-static uint8_t parse_variable(const char* message)
+static int parse_variable(const char* message)
 {
     consume(token_identifier, message);
     declare_variable();
-    return current->scope_depth > 0 ? 0 : identifier_constant(&parser.previous);
+    return current->scope_depth > 0 ? 0 : identifier_global(&parser.previous);
 }
 
 static void mark_initialized()
@@ -398,7 +517,7 @@ static void mark_initialized()
     }
 }
 
-static void define_variable(uint8_t global)
+static void define_variable(int global)
 {
     if (current->scope_depth > 0)
     {
@@ -406,7 +525,7 @@ static void define_variable(uint8_t global)
     }
     else if (current->scope_depth == 0)
     {
-        emit_bytes(op_define_global, global);
+        emit_global(op_define_global, global);
     }
 }
 
@@ -419,7 +538,7 @@ static void expression_statement()
 {
     expression();
     consume(token_semicolon, "Expect ';' after expression.");
-    emit_byte(op_pop);
+    emit_pop();
 }
 
 static void print_statement()
@@ -463,7 +582,7 @@ static void synchronize()
 
 static void var_declaration()
 {
-    uint8_t global = parse_variable("Expect variable name.");
+    int global = parse_variable("Expect variable name.");
     if (match(token_equal))
     {
         expression();
@@ -514,8 +633,8 @@ static void function(Function_type type)
             {
                 error_at_current("Can't have more than 255 parameters.");
             }
-            uint8_t constant = parse_variable("Expect parameter name.");
-            define_variable(constant);
+            int slot = parse_variable("Expect parameter name.");
+            define_variable(slot);
         }
         while (match(token_comma));
     }
@@ -639,20 +758,29 @@ static void named_variable(Token name, bool can_assign)
         }
         else
         {
-            arg = identifier_constant(&name);
+            arg = identifier_global(&name);
             get_op = op_get_global;
             set_op = op_set_global;
         }
     }
 
+    uint8_t op = get_op;
     if (can_assign && match(token_equal))
     {
         expression();
-        emit_bytes(set_op, (uint8_t)arg);
+        op = set_op;
+    }
+    if (op == op_get_global || op == op_set_global)
+    {
+        emit_global(op, arg);
     }
     else
     {
-        emit_bytes(get_op, (uint8_t)arg);
+        if (op == op_get_local || op == op_set_local)
+        {
+            current->last_operand = current_chunk()->count;
+        }
+        emit_bytes(op, (uint8_t)arg);
     }
 }
 
@@ -672,9 +800,10 @@ static void class_declaration()
     consume(token_identifier, "Expect class name.");
     Token class_name = parser.previous;
     uint8_t name_constant = identifier_constant(&parser.previous);
+    int global = current->scope_depth > 0 ? 0 : identifier_global(&parser.previous);
     declare_variable();
     emit_bytes(op_class, name_constant);
-    define_variable(name_constant);
+    define_variable(global);
     Class_compiler class_compiler = {.enclosing = current_class, .has_superclass = false};
     current_class = &class_compiler;
     if (match(token_less))
@@ -709,7 +838,7 @@ static void class_declaration()
 
 static void fun_declaration()
 {
-    uint8_t global = parse_variable("Expect function name.");
+    int global = parse_variable("Expect function name.");
     mark_initialized();
     function(type_function);
     define_variable(global);
@@ -747,7 +876,7 @@ static void for_statement()
         int body_jump = emit_jump(op_jump);
         int increment_start = current_chunk()->count;
         expression();
-        emit_byte(op_pop);
+        emit_pop();
         consume(token_right_paren, "Expect ')' after for clauses.");
         emit_loop(loop_start);
         loop_start = increment_start;
@@ -801,6 +930,27 @@ static void return_statement()
         }
         expression();
         consume(token_semicolon, "Expect ';' after return value.");
+        // A call that is the last thing the value computes becomes a tail
+        // call, be it of a function or a method. The return stays behind it
+        // for any short-circuit jump that lands after the call.
+        if (current->last_call_end == current_chunk()->count)
+        {
+            uint8_t* instruction = &current_chunk()->code[current->last_call];
+            switch (*instruction)
+            {
+            case op_call:
+                *instruction = op_tail_call;
+                break;
+            case op_invoke:
+                *instruction = op_tail_invoke;
+                break;
+            case op_super_invoke:
+                *instruction = op_tail_super_invoke;
+                break;
+            default:
+                break;
+            }
+        }
         emit_byte(op_return);
     }
 }
@@ -918,38 +1068,42 @@ static void binary(bool can_assign)
     Token_type operator = parser.previous.type;
     Rule* rule = get_rule(operator);
     Precedence precedence = (Precedence)(rule->precedence + 1);
+    int left = local_operand();
     parse(precedence);
     switch (operator)
     {
     case token_bang_equal:
-        emit_bytes(op_equal, op_not);
+        emit_operator(left, op_equal, op_equal_locals, op_equal_constant);
+        emit_byte(op_not);
         break;
     case token_equal_equal:
-        emit_byte(op_equal);
+        emit_operator(left, op_equal, op_equal_locals, op_equal_constant);
         break;
     case token_greater:
-        emit_byte(op_greater);
+        emit_operator(left, op_greater, op_greater_locals, op_greater_constant);
         break;
     case token_greater_equal:
-        emit_bytes(op_less, op_not);
+        emit_operator(left, op_less, op_less_locals, op_less_constant);
+        emit_byte(op_not);
         break;
     case token_less:
-        emit_byte(op_less);
+        emit_operator(left, op_less, op_less_locals, op_less_constant);
         break;
     case token_less_equal:
-        emit_bytes(op_greater, op_not);
+        emit_operator(left, op_greater, op_greater_locals, op_greater_constant);
+        emit_byte(op_not);
         break;
     case token_plus:
-        emit_byte(op_add);
+        emit_operator(left, op_add, op_add_locals, op_add_constant);
         break;
     case token_minus:
-        emit_byte(op_subtract);
+        emit_operator(left, op_subtract, op_subtract_locals, op_subtract_constant);
         break;
     case token_star:
-        emit_byte(op_multiply);
+        emit_operator(left, op_multiply, op_multiply_locals, op_multiply_constant);
         break;
     case token_slash:
-        emit_byte(op_divide);
+        emit_operator(left, op_divide, op_divide_locals, op_divide_constant);
         break;
     default:
         break;
@@ -980,7 +1134,9 @@ static void call(bool can_assign)
 {
     (void)can_assign;
     uint8_t arg_count = argument_list();
+    int start = current_chunk()->count;
     emit_bytes(op_call, arg_count);
+    mark_call(start);
 }
 
 static void dot(bool can_assign)
@@ -991,16 +1147,21 @@ static void dot(bool can_assign)
     {
         expression();
         emit_bytes(op_set_property, name);
+        emit_cache();
     }
     else if (match(token_left_paren))
     {
         uint8_t arg_count = argument_list();
+        int start = current_chunk()->count;
         emit_bytes(op_invoke, name);
         emit_byte(arg_count);
+        emit_cache();
+        mark_call(start);
     }
     else
     {
         emit_bytes(op_get_property, name);
+        emit_cache();
     }
 }
 
@@ -1092,8 +1253,10 @@ static void super_(bool can_assign)
     {
         uint8_t arg_count = argument_list();
         named_variable(synthetic_token("super"), false);
+        int start = current_chunk()->count;
         emit_bytes(op_super_invoke, name);
         emit_byte(arg_count);
+        mark_call(start);
     }
     else
     {
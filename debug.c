@@ -5,6 +5,7 @@
 #include "debug.h"
 #include "object.h"
 #include "value.h"
+#include "vm.h"
 
 static int constant_instruction(const char* name, Chunk* chunk, int offset)
 {
@@ -15,6 +16,16 @@ static int constant_instruction(const char* name, Chunk* chunk, int offset)
     return offset + 2;
 }
 
+static int global_instruction(const char* name, Chunk* chunk, int offset)
+{
+    uint16_t slot = (uint16_t)(chunk->code[offset + 1] << 8);
+    slot |= chunk->code[offset + 2];
+    printf("%-16s %4d '", name, slot);
+    print_value(vm.global_names.values[slot]);
+    printf("'\n");
+    return offset + 3;
+}
+
 static int simple_instruction(const char* name, int offset)
 {
     printf("%s\n", name);
@@ -34,6 +45,24 @@ static int byte_instruction(const char* name, Chunk* chunk, int offset)
     return offset + 2;
 }
 
+static int locals_instruction(const char* name, Chunk* chunk, int offset)
+{
+    uint8_t a = chunk->code[offset + 1];
+    uint8_t b = chunk->code[offset + 2];
+    printf("%-16s %4d %4d\n", name, a, b);
+    return offset + 3;
+}
+
+static int local_constant_instruction(const char* name, Chunk* chunk, int offset)
+{
+    uint8_t slot = chunk->code[offset + 1];
+    uint8_t constant = chunk->code[offset + 2];
+    printf("%-16s %4d %4d '", name, slot, constant);
+    print_value(chunk->constants.values[constant]);
+    printf("'\n");
+    return offset + 3;
+}
+
 static int jump_instruction(const char* name, int sign, Chunk* chunk, int offset)
 {
     uint16_t jump = (uint16_t)(chunk->code[offset + 1] << 8);
@@ -59,6 +88,29 @@ static int closure_instruction(const char* name, Chunk* chunk, int offset)
     }
     return offset;
 }
+static int property_instruction(const char* name, Chunk* chunk, int offset)
+{
+    uint8_t constant = chunk->code[offset + 1];
+    uint16_t cache = (uint16_t)(chunk->code[offset + 2] << 8);
+    cache |= chunk->code[offset + 3];
+    printf("%-16s %4d '", name, constant);
+    print_value(chunk->constants.values[constant]);
+    printf("' [cache %d]\n", cache);
+    return offset + 4;
+}
+
+static int cached_invoke_instruction(const char* name, Chunk* chunk, int offset)
+{
+    uint8_t constant = chunk->code[offset + 1];
+    uint8_t arg_count = chunk->code[offset + 2];
+    uint16_t cache = (uint16_t)(chunk->code[offset + 3] << 8);
+    cache |= chunk->code[offset + 4];
+    printf("%-16s (%d args) %d'", name, arg_count, constant);
+    print_value(chunk->constants.values[constant]);
+    printf("' [cache %d]\n", cache);
+    return offset + 5;
+}
+
 static int invoke_instruction(const char* name, Chunk* chunk, int offset)
 {
     uint8_t constant = chunk->code[offset + 1];
@@ -127,19 +179,19 @@ int disassemble_instruction(Chunk* chunk, int offset)
         next = simple_instruction("OP_CLOSE_UPVALUE", offset);
         break;
     case op_get_global:
-        next = constant_instruction("OP_GET_GLOBAL", chunk, offset);
+        next = global_instruction("OP_GET_GLOBAL", chunk, offset);
         break;
     case op_define_global:
-        next = constant_instruction("OP_DEFINE_GLOBAL", chunk, offset);
+        next = global_instruction("OP_DEFINE_GLOBAL", chunk, offset);
         break;
     case op_set_global:
-        next = constant_instruction("OP_SET_GLOBAL", chunk, offset);
+        next = global_instruction("OP_SET_GLOBAL", chunk, offset);
         break;
     case op_get_property:
-        next = constant_instruction("OP_GET_PROPERTY", chunk, offset);
+        next = property_instruction("OP_GET_PROPERTY", chunk, offset);
         break;
     case op_set_property:
-        next = constant_instruction("OP_SET_PROPERTY", chunk, offset);
+        next = property_instruction("OP_SET_PROPERTY", chunk, offset);
         break;
     case op_get_super:
         next = constant_instruction("OP_GET_SUPER", chunk, offset);
@@ -189,12 +241,21 @@ int disassemble_instruction(Chunk* chunk, int offset)
     case op_call:
         next = byte_instruction("OP_CALL", chunk, offset);
         break;
+    case op_tail_call:
+        next = byte_instruction("OP_TAIL_CALL", chunk, offset);
+        break;
     case op_invoke:
-        next = invoke_instruction("OP_INVOKE", chunk, offset);
+        next = cached_invoke_instruction("OP_INVOKE", chunk, offset);
+        break;
+    case op_tail_invoke:
+        next = cached_invoke_instruction("OP_TAIL_INVOKE", chunk, offset);
         break;
     case op_super_invoke:
         next = invoke_instruction("OP_SUPER_INVOKE", chunk, offset);
         break;
+    case op_tail_super_invoke:
+        next = invoke_instruction("OP_TAIL_SUPER_INVOKE", chunk, offset);
+        break;
     case op_closure:
         next = closure_instruction("OP_CLOSURE", chunk, offset);
         break;
@@ -207,6 +268,69 @@ int disassemble_instruction(Chunk* chunk, int offset)
     case op_inherit:
         next = simple_instruction("OP_INHERIT", offset);
         break;
+    case op_equal_locals:
+        next = locals_instruction("OP_EQUAL_LOCALS", chunk, offset);
+        break;
+    case op_greater_locals:
+        next = locals_instruction("OP_GREATER_LOCALS", chunk, offset);
+        break;
+    case op_less_locals:
+        next = locals_instruction("OP_LESS_LOCALS", chunk, offset);
+        break;
+    case op_add_locals:
+        next = locals_instruction("OP_ADD_LOCALS", chunk, offset);
+        break;
+    case op_subtract_locals:
+        next = locals_instruction("OP_SUBTRACT_LOCALS", chunk, offset);
+        break;
+    case op_multiply_locals:
+        next = locals_instruction("OP_MULTIPLY_LOCALS", chunk, offset);
+        break;
+    case op_divide_locals:
+        next = locals_instruction("OP_DIVIDE_LOCALS", chunk, offset);
+        break;
+    case op_equal_constant:
+        next = local_constant_instruction("OP_EQUAL_CONSTANT", chunk, offset);
+        break;
+    case op_greater_constant:
+        next = local_constant_instruction("OP_GREATER_CONSTANT", chunk, offset);
+        break;
+    case op_less_constant:
+        next = local_constant_instruction("OP_LESS_CONSTANT", chunk, offset);
+        break;
+    case op_add_constant:
+        next = local_constant_instruction("OP_ADD_CONSTANT", chunk, offset);
+        break;
+    case op_subtract_constant:
+        next = local_constant_instruction("OP_SUBTRACT_CONSTANT", chunk, offset);
+        break;
+    case op_multiply_constant:
+        next = local_constant_instruction("OP_MULTIPLY_CONSTANT", chunk, offset);
+        break;
+    case op_divide_constant:
+        next = local_constant_instruction("OP_DIVIDE_CONSTANT", chunk, offset);
+        break;
+    case op_pop_local:
+        next = byte_instruction("OP_POP_LOCAL", chunk, offset);
+        break;
+    case op_add_number:
+        next = simple_instruction("OP_ADD_NUMBER", offset);
+        break;
+    case op_subtract_number:
+        next = simple_instruction("OP_SUBTRACT_NUMBER", offset);
+        break;
+    case op_multiply_number:
+        next = simple_instruction("OP_MULTIPLY_NUMBER", offset);
+        break;
+    case op_divide_number:
+        next = simple_instruction("OP_DIVIDE_NUMBER", offset);
+        break;
+    case op_greater_number:
+        next = simple_instruction("OP_GREATER_NUMBER", offset);
+        break;
+    case op_less_number:
+        next = simple_instruction("OP_LESS_NUMBER", offset);
+        break;
     default:
         next = unknown_instruction(instruction, offset);
         break;
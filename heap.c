@@ -0,0 +1,341 @@
+// MAP_ANONYMOUS and madvise() are not part of strict C11 builds.
+#define _DEFAULT_SOURCE
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "heap.h"
+
+#ifdef __unix__
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+static size_t class_index(size_t size)
+{
+    return (size + heap_cell_granule - 1) / heap_cell_granule - 1;
+}
+
+// Cells start past the page header, aligned to the granule.
+static size_t first_cell_offset()
+{
+    return (sizeof(Page) + heap_cell_granule - 1) / heap_cell_granule * heap_cell_granule;
+}
+
+static void* checked(void* pointer)
+{
+    if (pointer == NULL)
+    {
+        exit(1);
+    }
+    return pointer;
+}
+
+// Maps an arena aligned to its size, so that with HUGE_PAGES it can be
+// backed by transparent huge pages.
+static void* map_arena()
+{
+    void* result;
+#ifdef __unix__
+    size_t size = heap_arena_size * 2;
+    char* mapping = (char*)mmap(NULL, size, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mapping == MAP_FAILED)
+    {
+        exit(1);
+    }
+    char* start = (char*)(((uintptr_t)mapping + heap_arena_size - 1)
+        & ~(uintptr_t)(heap_arena_size - 1));
+    if (start > mapping)
+    {
+        munmap(mapping, (size_t)(start - mapping));
+    }
+    munmap(start + heap_arena_size, (size_t)(mapping + size - start - heap_arena_size));
+#if defined(HUGE_PAGES) && defined(MADV_HUGEPAGE)
+    madvise(start, heap_arena_size, MADV_HUGEPAGE);
+#endif
+    result = start;
+#else
+    result = checked(aligned_alloc(heap_arena_size, heap_arena_size));
+#endif
+    return result;
+}
+
+static void unmap_arena(void* start)
+{
+#ifdef __unix__
+    munmap(start, heap_arena_size);
+#else
+    free(start);
+#endif
+}
+
+static void add_arena(Heap* heap)
+{
+    Arena* arena = (Arena*)checked(malloc(sizeof(Arena)));
+    arena->start = map_arena();
+    arena->next = heap->arenas;
+    heap->arenas = arena;
+    heap->arena_top = (char*)arena->start;
+    heap->arena_end = heap->arena_top + heap_arena_size;
+}
+
+// Takes a page from the empty pool, or else a fresh one from an arena.
+static Page* new_page(Heap* heap)
+{
+    Page* page = heap->empty;
+    if (page != NULL)
+    {
+        heap->empty = page->next_free;
+    }
+    else
+    {
+        if (heap->arena_top == heap->arena_end)
+        {
+            add_arena(heap);
+        }
+        page = (Page*)heap->arena_top;
+        heap->arena_top += heap_page_size;
+        uint64_t* maps = (uint64_t*)checked(calloc(heap_map_words * 3, sizeof(uint64_t)));
+        page->marks = maps;
+        page->remembered = maps + heap_map_words;
+        page->live = maps + heap_map_words * 2;
+        page->next = heap->pages;
+        heap->pages = page;
+    }
+    return page;
+}
+
+static void format_page(Page* page, Size_class* class, size_t cell_size)
+{
+    size_t cells = (heap_page_size - first_cell_offset()) / cell_size;
+    page->next_free = NULL;
+    page->previous_free = NULL;
+    page->class = class;
+    page->cell_size = cell_size;
+    page->free = NULL;
+    page->top = (char*)page + first_cell_offset();
+    page->end = page->top + cells * cell_size;
+    page->live_count = 0;
+    page->listed = false;
+    page->dirty = true;
+}
+
+static void list_page(Size_class* class, Page* page)
+{
+    page->previous_free = NULL;
+    page->next_free = class->available;
+    if (class->available != NULL)
+    {
+        class->available->previous_free = page;
+    }
+    class->available = page;
+    page->listed = true;
+}
+
+static void unlist_page(Size_class* class, Page* page)
+{
+    if (page->previous_free != NULL)
+    {
+        page->previous_free->next_free = page->next_free;
+    }
+    else
+    {
+        class->available = page->next_free;
+    }
+    if (page->next_free != NULL)
+    {
+        page->next_free->previous_free = page->previous_free;
+    }
+    page->listed = false;
+}
+
+void init_heap(Heap* heap)
+{
+    for (int i = 0; i < heap_class_count; i++)
+    {
+        heap->classes[i].current = NULL;
+        heap->classes[i].available = NULL;
+    }
+    heap->pages = NULL;
+    heap->empty = NULL;
+    heap->arenas = NULL;
+    heap->arena_top = NULL;
+    heap->arena_end = NULL;
+}
+
+void free_heap(Heap* heap)
+{
+    for (Page* page = heap->pages; page != NULL; page = page->next)
+    {
+        free(page->marks);
+    }
+    Arena* arena = heap->arenas;
+    while (arena != NULL)
+    {
+        Arena* next = arena->next;
+        unmap_arena(arena->start);
+        free(arena);
+        arena = next;
+    }
+    init_heap(heap);
+}
+
+// A cell allocated while the background sweeper runs must be marked before
+// it is seen as live, or the sweeper could free it, hence the release store
+// matched by the acquire load in heap_sweep_page().
+void* heap_allocate(Heap* heap, size_t size, bool marked)
+{
+    Size_class* class = &heap->classes[class_index(size)];
+    Page* page = class->current;
+    if (page == NULL || (page->free == NULL && page->top == page->end))
+    {
+        page = class->available;
+        if (page != NULL)
+        {
+            unlist_page(class, page);
+        }
+        else
+        {
+            page = new_page(heap);
+            format_page(page, class, (class_index(size) + 1) * heap_cell_granule);
+        }
+        class->current = page;
+    }
+    void* result;
+    if (page->free != NULL)
+    {
+        result = page->free;
+        page->free = page->free->next;
+    }
+    else
+    {
+        result = page->top;
+        page->top += page->cell_size;
+    }
+    page->live_count++;
+    size_t granule = granule_of(result);
+    if (marked)
+    {
+        set_bit(page->marks, granule);
+    }
+    uint64_t* word = &page->live[granule / 64];
+    __atomic_store_n(word, load_bits(word) | (uint64_t)1 << (granule % 64), __ATOMIC_RELEASE);
+    return result;
+}
+
+// A page that empties out goes to the empty pool unless its class is
+// allocating from it; one that regains free cells becomes available.
+void heap_free(Heap* heap, void* pointer)
+{
+    Page* page = page_of(pointer);
+    Cell* cell = (Cell*)pointer;
+    cell->next = page->free;
+    page->free = cell;
+    clear_bit(page->live, granule_of(pointer));
+    page->live_count--;
+    Size_class* class = page->class;
+    if (page != class->current)
+    {
+        if (page->live_count == 0)
+        {
+            if (page->listed)
+            {
+                unlist_page(class, page);
+            }
+            page->next_free = heap->empty;
+            heap->empty = page;
+        }
+        else if (!page->listed)
+        {
+            list_page(class, page);
+        }
+    }
+}
+
+// Lets a thread that doesn't own the heap free cells into a list of its
+// own, to be handed back later with heap_reclaim().
+void cell_list_add(Cell_list* list, void* pointer)
+{
+    Cell* cell = (Cell*)pointer;
+    cell->next = list->first;
+    list->first = cell;
+}
+
+void heap_reclaim(Heap* heap, Cell_list* list)
+{
+    Cell* cell = list->first;
+    while (cell != NULL)
+    {
+        Cell* next = cell->next;
+        heap_free(heap, cell);
+        cell = next;
+    }
+    list->first = NULL;
+}
+
+// Frees each cell of the page that is allocated but unmarked through
+// release(), which must not allocate. Returns how many cells it freed.
+size_t heap_sweep_page(Page* page, void (*release)(void* cell))
+{
+    size_t count = 0;
+    for (int i = 0; i < heap_map_words; i++)
+    {
+        uint64_t dead = __atomic_load_n(&page->live[i], __ATOMIC_ACQUIRE)
+            & ~load_bits(&page->marks[i]);
+        while (dead != 0)
+        {
+            size_t bit = (size_t)__builtin_ctzll(dead);
+            dead &= dead - 1;
+            release(cell_at(page, (size_t)i * 64 + bit));
+            count++;
+        }
+    }
+    return count;
+}
+
+void heap_visit_marked(Heap* heap, void (*visit)(void* cell))
+{
+    for (Page* page = heap->pages; page != NULL; page = page->next)
+    {
+        for (int i = 0; i < heap_map_words; i++)
+        {
+            uint64_t marked = load_bits(&page->live[i]) & load_bits(&page->marks[i]);
+            while (marked != 0)
+            {
+                size_t bit = (size_t)__builtin_ctzll(marked);
+                marked &= marked - 1;
+                visit(cell_at(page, (size_t)i * 64 + bit));
+            }
+        }
+    }
+}
+
+void heap_clear_marks(Heap* heap)
+{
+    for (Page* page = heap->pages; page != NULL; page = page->next)
+    {
+        memset(page->marks, 0, sizeof(uint64_t) * heap_map_words);
+    }
+}
+
+// Gives the memory of empty pages back to the system, all but the first
+// system page, which holds the header. Huge pages are kept whole instead.
+void heap_release_empty(Heap* heap)
+{
+#if defined(__unix__) && !defined(HUGE_PAGES)
+    size_t system_page = (size_t)sysconf(_SC_PAGESIZE);
+    for (Page* page = heap->empty; page != NULL; page = page->next_free)
+    {
+        if (page->dirty && system_page < heap_page_size)
+        {
+            madvise((char*)page + system_page, heap_page_size - system_page, MADV_DONTNEED);
+            page->dirty = false;
+        }
+    }
+#else
+    (void)heap;
+#endif
+}
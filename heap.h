@@ -0,0 +1,176 @@
+#ifndef clox_heap
+#define clox_heap
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+enum Heap_parameter
+{
+    heap_page_size = 64 * 1024,
+    heap_arena_size = 2 * 1024 * 1024,
+    heap_cell_granule = 16,
+    heap_max_cell = 256,
+    heap_class_count = heap_max_cell / heap_cell_granule,
+    heap_map_words = heap_page_size / heap_cell_granule / 64
+};
+
+typedef struct Cell
+{
+    struct Cell* next;
+} Cell;
+
+// Cells freed on a thread that doesn't own the heap, waiting to go back.
+typedef struct
+{
+    Cell* first;
+} Cell_list;
+
+// A page holds cells of a single size and keeps its own free list. Its
+// bitmaps are allocated apart from the page, with one bit per granule at the
+// start of each cell, so marking and sweeping never write to the objects:
+// live bits say which cells are allocated, mark bits which survived the
+// collection and remembered bits which old objects are in the remembered
+// set. The background sweeper reads live and mark bits while the
+// interpreter allocates, so bitmaps are accessed with relaxed atomics.
+typedef struct Size_class Size_class;
+
+typedef struct Page
+{
+    struct Page* next;
+    struct Page* next_free;
+    struct Page* previous_free;
+    Size_class* class;
+    size_t cell_size;
+    Cell* free;
+    char* top;
+    char* end;
+    int live_count;
+    bool listed;
+    bool dirty;
+    uint64_t* marks;
+    uint64_t* remembered;
+    uint64_t* live;
+} Page;
+
+// A size class allocates from its current page, then from the other pages
+// of the class that have free cells.
+struct Size_class
+{
+    Page* current;
+    Page* available;
+};
+
+typedef struct Arena
+{
+    struct Arena* next;
+    void* start;
+} Arena;
+
+// Memory for objects. Pages are aligned to their size, so the page holding
+// an object is found from its address, and are carved out of large mapped
+// arenas. Pages that empty out go to a pool any size class can reuse; their
+// memory goes back to the system at the end of a full collection. Cells are
+// at most heap_max_cell bytes.
+typedef struct
+{
+    Size_class classes[heap_class_count];
+    Page* pages;
+    Page* empty;
+    Arena* arenas;
+    char* arena_top;
+    char* arena_end;
+} Heap;
+
+static inline Page* page_of(const void* cell)
+{
+    return (Page*)((uintptr_t)cell & ~(uintptr_t)(heap_page_size - 1));
+}
+
+static inline size_t granule_of(const void* cell)
+{
+    return ((uintptr_t)cell & (heap_page_size - 1)) / heap_cell_granule;
+}
+
+static inline void* cell_at(Page* page, size_t granule)
+{
+    return (char*)page + granule * heap_cell_granule;
+}
+
+static inline uint64_t load_bits(const uint64_t* word)
+{
+    return __atomic_load_n(word, __ATOMIC_RELAXED);
+}
+
+// Only one thread writes a bitmap at a time, though others may read it.
+static inline void store_bits(uint64_t* word, uint64_t bits)
+{
+    __atomic_store_n(word, bits, __ATOMIC_RELAXED);
+}
+
+static inline bool test_bit(const uint64_t* map, size_t granule)
+{
+    return (load_bits(&map[granule / 64]) >> (granule % 64)) & 1;
+}
+
+static inline void set_bit(uint64_t* map, size_t granule)
+{
+    store_bits(&map[granule / 64], load_bits(&map[granule / 64]) | (uint64_t)1 << (granule % 64));
+}
+
+static inline void clear_bit(uint64_t* map, size_t granule)
+{
+    store_bits(&map[granule / 64],
+        load_bits(&map[granule / 64]) & ~((uint64_t)1 << (granule % 64)));
+}
+
+static inline bool is_marked(const void* cell)
+{
+    return test_bit(page_of(cell)->marks, granule_of(cell));
+}
+
+static inline void set_mark(const void* cell)
+{
+    set_bit(page_of(cell)->marks, granule_of(cell));
+}
+
+static inline void clear_mark(const void* cell)
+{
+    clear_bit(page_of(cell)->marks, granule_of(cell));
+}
+
+static inline bool is_remembered(const void* cell)
+{
+    return test_bit(page_of(cell)->remembered, granule_of(cell));
+}
+
+static inline void set_remembered(const void* cell)
+{
+    set_bit(page_of(cell)->remembered, granule_of(cell));
+}
+
+static inline void clear_remembered(const void* cell)
+{
+    clear_bit(page_of(cell)->remembered, granule_of(cell));
+}
+
+// Sets the mark from any thread. Returns false if it was already set.
+static inline bool claim_mark(const void* cell)
+{
+    size_t granule = granule_of(cell);
+    uint64_t bit = (uint64_t)1 << (granule % 64);
+    return !(__atomic_fetch_or(&page_of(cell)->marks[granule / 64], bit, __ATOMIC_RELAXED) & bit);
+}
+
+void init_heap(Heap* heap);
+void free_heap(Heap* heap);
+void* heap_allocate(Heap* heap, size_t size, bool marked);
+void heap_free(Heap* heap, void* pointer);
+void cell_list_add(Cell_list* list, void* pointer);
+void heap_reclaim(Heap* heap, Cell_list* list);
+size_t heap_sweep_page(Page* page, void (*release)(void* cell));
+void heap_visit_marked(Heap* heap, void (*visit)(void* cell));
+void heap_clear_marks(Heap* heap);
+void heap_release_empty(Heap* heap);
+
+#endif
@@ -0,0 +1,1026 @@
+// MAP_ANONYMOUS is not part of strict C11 builds.
+#define _DEFAULT_SOURCE
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "chunk.h"
+#include "jit.h"
+#include "object.h"
+#include "value.h"
+#include "vm.h"
+
+#ifdef JIT
+
+#include <limits.h>
+#include <sys/mman.h>
+
+// A template JIT. Each bytecode instruction is translated on its own into
+// x86-64 that works on the same VM state the interpreter uses: rbx holds the
+// stack top, r12 the frame's slots and r13 the Call_frame. Instructions
+// without a native template, and number guards that fail, leave compiled
+// code through a side exit that stores the stack top and the bytecode
+// address of the instruction back into the frame. The interpreter then runs
+// that instruction with its usual helpers (call_value, invoke, add, ...)
+// and re-enters native code after calls, returns and loop back-edges.
+
+typedef enum
+{
+    reg_rax,
+    reg_rcx,
+    reg_rdx,
+    reg_rbx,
+    reg_rsp,
+    reg_rbp,
+    reg_rsi,
+    reg_rdi,
+    reg_r8,
+    reg_r9,
+    reg_r10,
+    reg_r11,
+    reg_r12,
+    reg_r13,
+    reg_r14,
+    reg_r15,
+    reg_sp = reg_rbx,
+    reg_slots = reg_r12,
+    reg_frame = reg_r13
+} Register;
+
+typedef enum
+{
+    cond_equal = 0x4,
+    cond_not_equal = 0x5,
+    cond_above = 0x7,
+    cond_parity = 0xa
+} Condition;
+
+typedef enum
+{
+    alu_or = 0x09,
+    alu_and = 0x21,
+    alu_xor = 0x31,
+    alu_cmp = 0x39
+} Alu;
+
+typedef enum
+{
+    sse_load = 0x10,
+    sse_store = 0x11,
+    sse_ucomis = 0x2e,
+    sse_add = 0x58,
+    sse_multiply = 0x59,
+    sse_subtract = 0x5c,
+    sse_divide = 0x5e
+} Sse;
+
+enum Sse_prefix
+{
+    prefix_none = 0x00,
+    prefix_double = 0xf2,
+    prefix_operand = 0x66
+};
+
+// A rel32 displacement at code offset `at` waiting for the native address of
+// bytecode offset `target`.
+typedef struct
+{
+    size_t at;
+    int target;
+} Patch;
+
+typedef struct
+{
+    Chunk* chunk;
+    uint8_t* code;
+    size_t count;
+    size_t capacity;
+    int* offsets;
+    size_t exit_stub;
+    Patch* jumps;
+    int jump_count;
+    int jump_capacity;
+    Patch* exits;
+    int exit_count;
+    int exit_capacity;
+} Assembler;
+
+static const int32_t value_size = (int32_t)sizeof(Value);
+
+#ifdef NAN_BOXING
+static const int32_t number_offset = 0;
+#else
+static const int32_t number_offset = (int32_t)offsetof(Value, as);
+#endif
+
+static void* grow(void* pointer, size_t size)
+{
+    void* result = realloc(pointer, size);
+    if (result == NULL)
+    {
+        exit(1);
+    }
+    return result;
+}
+
+static void emit(Assembler* as, uint8_t byte)
+{
+    if (as->capacity < as->count + 1)
+    {
+        as->capacity = as->capacity < 256 ? 256 : as->capacity * 2;
+        as->code = (uint8_t*)grow(as->code, as->capacity);
+    }
+    as->code[as->count++] = byte;
+}
+
+static void emit32(Assembler* as, uint32_t value)
+{
+    for (int i = 0; i < 4; i++)
+    {
+        emit(as, (uint8_t)(value >> (8 * i)));
+    }
+}
+
+static void emit64(Assembler* as, uint64_t value)
+{
+    for (int i = 0; i < 8; i++)
+    {
+        emit(as, (uint8_t)(value >> (8 * i)));
+    }
+}
+
+static void add_patch(Patch** patches, int* count, int* capacity, size_t at, int target)
+{
+    if (*capacity < *count + 1)
+    {
+        *capacity = *capacity < 8 ? 8 : *capacity * 2;
+        *patches = (Patch*)grow(*patches, sizeof(Patch) * *capacity);
+    }
+    (*patches)[*count].at = at;
+    (*patches)[*count].target = target;
+    (*count)++;
+}
+
+static void patch(Assembler* as, size_t at, size_t target)
+{
+    uint32_t displacement = (uint32_t)((int64_t)target - (int64_t)(at + 4));
+    for (int i = 0; i < 4; i++)
+    {
+        as->code[at + i] = (uint8_t)(displacement >> (8 * i));
+    }
+}
+
+static void patch_here(Assembler* as, size_t at)
+{
+    patch(as, at, as->count);
+}
+
+static void rex(Assembler* as, bool wide, int reg, int base)
+{
+    uint8_t prefix = (uint8_t)(0x40 | (wide ? 0x08 : 0) | ((reg & 8) ? 0x04 : 0) | ((base & 8) ? 0x01 : 0));
+    if (prefix != 0x40)
+    {
+        emit(as, prefix);
+    }
+}
+
+static void memory_operand(Assembler* as, int reg, int base, int32_t displacement)
+{
+    emit(as, (uint8_t)(0x80 | ((reg & 7) << 3) | (base & 7)));
+    if ((base & 7) == reg_rsp)
+    {
+        emit(as, 0x24);
+    }
+    emit32(as, (uint32_t)displacement);
+}
+
+static void register_operand(Assembler* as, int reg, int rm)
+{
+    emit(as, (uint8_t)(0xc0 | ((reg & 7) << 3) | (rm & 7)));
+}
+
+static void load(Assembler* as, Register dst, Register base, int32_t displacement)
+{
+    rex(as, true, dst, base);
+    emit(as, 0x8b);
+    memory_operand(as, dst, base, displacement);
+}
+
+static void store(Assembler* as, Register base, int32_t displacement, Register src)
+{
+    rex(as, true, src, base);
+    emit(as, 0x89);
+    memory_operand(as, src, base, displacement);
+}
+
+static void move_immediate(Assembler* as, Register dst, uint64_t value)
+{
+    rex(as, true, 0, dst);
+    emit(as, (uint8_t)(0xb8 + (dst & 7)));
+    emit64(as, value);
+}
+
+static void move(Assembler* as, Register dst, Register src)
+{
+    rex(as, true, src, dst);
+    emit(as, 0x89);
+    register_operand(as, src, dst);
+}
+
+static void arithmetic(Assembler* as, Alu alu, Register dst, Register src)
+{
+    rex(as, true, src, dst);
+    emit(as, (uint8_t)alu);
+    register_operand(as, src, dst);
+}
+
+static void add_immediate(Assembler* as, Register dst, int32_t value)
+{
+    rex(as, true, 0, dst);
+    emit(as, 0x81);
+    register_operand(as, 0, dst);
+    emit32(as, (uint32_t)value);
+}
+
+#ifndef NAN_BOXING
+static void compare_dword(Assembler* as, Register base, int32_t displacement, int32_t value)
+{
+    rex(as, false, 0, base);
+    emit(as, 0x81);
+    memory_operand(as, 7, base, displacement);
+    emit32(as, (uint32_t)value);
+}
+
+static void compare_byte(Assembler* as, Register base, int32_t displacement, uint8_t value)
+{
+    rex(as, false, 0, base);
+    emit(as, 0x80);
+    memory_operand(as, 7, base, displacement);
+    emit(as, value);
+}
+
+static void store_dword(Assembler* as, Register base, int32_t displacement, int32_t value)
+{
+    rex(as, false, 0, base);
+    emit(as, 0xc7);
+    memory_operand(as, 0, base, displacement);
+    emit32(as, (uint32_t)value);
+}
+
+static void store_al(Assembler* as, Register base, int32_t displacement)
+{
+    rex(as, false, 0, base);
+    emit(as, 0x88);
+    memory_operand(as, reg_rax, base, displacement);
+}
+#endif
+
+static void clear_eax(Assembler* as)
+{
+    emit(as, 0x31);
+    emit(as, 0xc0);
+}
+
+static void set_eax(Assembler* as, uint32_t value)
+{
+    emit(as, 0xb8);
+    emit32(as, value);
+}
+
+static void set_condition(Assembler* as, Condition condition)
+{
+    emit(as, 0x0f);
+    emit(as, (uint8_t)(0x90 | condition));
+    register_operand(as, 0, reg_rax);
+    emit(as, 0x0f);
+    emit(as, 0xb6);
+    register_operand(as, reg_rax, reg_rax);
+}
+
+static void sse_memory(Assembler* as, uint8_t prefix, Sse sse, int xmm, Register base,
+    int32_t displacement)
+{
+    if (prefix != prefix_none)
+    {
+        emit(as, prefix);
+    }
+    rex(as, false, xmm, base);
+    emit(as, 0x0f);
+    emit(as, (uint8_t)sse);
+    memory_operand(as, xmm, base, displacement);
+}
+
+static void sse_register(Assembler* as, uint8_t prefix, Sse sse, int dst, int src)
+{
+    emit(as, prefix);
+    emit(as, 0x0f);
+    emit(as, (uint8_t)sse);
+    register_operand(as, dst, src);
+}
+
+static size_t jump_forward(Assembler* as)
+{
+    emit(as, 0xe9);
+    emit32(as, 0);
+    return as->count - 4;
+}
+
+static size_t jump_forward_if(Assembler* as, Condition condition)
+{
+    emit(as, 0x0f);
+    emit(as, (uint8_t)(0x80 | condition));
+    emit32(as, 0);
+    return as->count - 4;
+}
+
+static void jump_to(Assembler* as, int target)
+{
+    size_t at = jump_forward(as);
+    add_patch(&as->jumps, &as->jump_count, &as->jump_capacity, at, target);
+}
+
+static void exit_if(Assembler* as, Condition condition, int instruction)
+{
+    size_t at = jump_forward_if(as, condition);
+    add_patch(&as->exits, &as->exit_count, &as->exit_capacity, at, instruction);
+}
+
+static void exit_at(Assembler* as, int instruction)
+{
+    move_immediate(as, reg_rax, (uint64_t)(uintptr_t)(as->chunk->code + instruction));
+    size_t at = jump_forward(as);
+    patch(as, at, as->exit_stub);
+}
+
+static void push_register(Assembler* as, Register reg)
+{
+    rex(as, false, 0, reg);
+    emit(as, (uint8_t)(0x50 + (reg & 7)));
+}
+
+static void pop_register(Assembler* as, Register reg)
+{
+    rex(as, false, 0, reg);
+    emit(as, (uint8_t)(0x58 + (reg & 7)));
+}
+
+static void copy_value(Assembler* as, Register dst, int32_t dst_offset, Register src,
+    int32_t src_offset)
+{
+#ifdef NAN_BOXING
+    load(as, reg_rax, src, src_offset);
+    store(as, dst, dst_offset, reg_rax);
+#else
+    // Two word moves rather than one 16-byte move: values are often written
+    // a word at a time just before, and a wider load would miss store
+    // forwarding.
+    load(as, reg_rax, src, src_offset);
+    load(as, reg_rcx, src, src_offset + 8);
+    store(as, dst, dst_offset, reg_rax);
+    store(as, dst, dst_offset + 8, reg_rcx);
+#endif
+}
+
+static void store_value(Assembler* as, Register base, int32_t offset, Value value)
+{
+    uint64_t words[sizeof(Value) / sizeof(uint64_t)];
+    memcpy(words, &value, sizeof(Value));
+    for (size_t i = 0; i < sizeof(Value) / sizeof(uint64_t); i++)
+    {
+        move_immediate(as, reg_rax, words[i]);
+        store(as, base, offset + (int32_t)(i * sizeof(uint64_t)), reg_rax);
+    }
+}
+
+static void push_value(Assembler* as, Value value)
+{
+    store_value(as, reg_sp, 0, value);
+    add_immediate(as, reg_sp, value_size);
+}
+
+static void guard_number(Assembler* as, int32_t offset, int instruction)
+{
+#ifdef NAN_BOXING
+    load(as, reg_rax, reg_sp, offset);
+    move_immediate(as, reg_rcx, qnan());
+    arithmetic(as, alu_and, reg_rax, reg_rcx);
+    arithmetic(as, alu_cmp, reg_rax, reg_rcx);
+    exit_if(as, cond_equal, instruction);
+#else
+    compare_dword(as, reg_sp, offset + (int32_t)offsetof(Value, type), val_number);
+    exit_if(as, cond_not_equal, instruction);
+#endif
+}
+
+static void guard_defined(Assembler* as, Register base, int32_t offset, int instruction)
+{
+#ifdef NAN_BOXING
+    load(as, reg_rax, base, offset);
+    move_immediate(as, reg_rcx, undefined_value());
+    arithmetic(as, alu_cmp, reg_rax, reg_rcx);
+#else
+    compare_dword(as, base, offset + (int32_t)offsetof(Value, type), val_undefined);
+#endif
+    exit_if(as, cond_equal, instruction);
+}
+
+// Stores the 0 or 1 in eax as a Lox boolean.
+static void store_bool(Assembler* as, int32_t offset)
+{
+#ifdef NAN_BOXING
+    move_immediate(as, reg_rcx, false_value());
+    arithmetic(as, alu_or, reg_rax, reg_rcx);
+    store(as, reg_sp, offset, reg_rax);
+#else
+    store_dword(as, reg_sp, offset + (int32_t)offsetof(Value, type), val_bool);
+    store_al(as, reg_sp, offset + (int32_t)offsetof(Value, as));
+#endif
+}
+
+// Emits jumps taken when the value at offset is falsey and returns how many
+// of them were written to patches. Falls through when it is truthy.
+static int branch_if_falsey(Assembler* as, int32_t offset, size_t patches[2])
+{
+#ifdef NAN_BOXING
+    load(as, reg_rax, reg_sp, offset);
+    move_immediate(as, reg_rcx, nil_value());
+    arithmetic(as, alu_cmp, reg_rax, reg_rcx);
+    patches[0] = jump_forward_if(as, cond_equal);
+    move_immediate(as, reg_rcx, false_value());
+    arithmetic(as, alu_cmp, reg_rax, reg_rcx);
+    patches[1] = jump_forward_if(as, cond_equal);
+#else
+    int32_t type = offset + (int32_t)offsetof(Value, type);
+    compare_dword(as, reg_sp, type, val_nil);
+    patches[0] = jump_forward_if(as, cond_equal);
+    compare_dword(as, reg_sp, type, val_bool);
+    size_t truthy = jump_forward_if(as, cond_not_equal);
+    compare_byte(as, reg_sp, offset + (int32_t)offsetof(Value, as), 0);
+    patches[1] = jump_forward_if(as, cond_equal);
+    patch_here(as, truthy);
+#endif
+    return 2;
+}
+
+// Binary operators take their operands from the two values below top,
+// an offset from the stack top, and leave the result in place of the first
+// one as the new top. Stack forms work at a top of 0. Register forms copy
+// their operands above the stack first, so the stack is untouched if a
+// guard exits.
+static void load_numbers(Assembler* as, int32_t top, int instruction)
+{
+    guard_number(as, top - 2 * value_size, instruction);
+    guard_number(as, top - value_size, instruction);
+    sse_memory(as, prefix_double, sse_load, 0, reg_sp, top - 2 * value_size + number_offset);
+    sse_memory(as, prefix_double, sse_load, 1, reg_sp, top - value_size + number_offset);
+}
+
+static void number_op(Assembler* as, Sse sse, int32_t top, int instruction)
+{
+    load_numbers(as, top, instruction);
+    sse_register(as, prefix_double, sse, 0, 1);
+    sse_memory(as, prefix_double, sse_store, 0, reg_sp, top - 2 * value_size + number_offset);
+    add_immediate(as, reg_sp, top - value_size);
+}
+
+static void compare_op(Assembler* as, bool greater, int32_t top, int instruction)
+{
+    load_numbers(as, top, instruction);
+    clear_eax(as);
+    if (greater)
+    {
+        sse_register(as, prefix_operand, sse_ucomis, 0, 1);
+    }
+    else
+    {
+        sse_register(as, prefix_operand, sse_ucomis, 1, 0);
+    }
+    set_condition(as, cond_above);
+    store_bool(as, top - 2 * value_size);
+    add_immediate(as, reg_sp, top - value_size);
+}
+
+static void equal_op(Assembler* as, int32_t top, int instruction)
+{
+#ifdef NAN_BOXING
+    // Anything but two numbers compares by bits, as in values_equal(),
+    // except two different objects, which might be equal strings and are
+    // left to the interpreter.
+    load(as, reg_rax, reg_sp, top - 2 * value_size);
+    load(as, reg_rdx, reg_sp, top - value_size);
+    move_immediate(as, reg_rcx, qnan());
+    move(as, reg_rsi, reg_rax);
+    arithmetic(as, alu_and, reg_rsi, reg_rcx);
+    arithmetic(as, alu_cmp, reg_rsi, reg_rcx);
+    size_t bits_a = jump_forward_if(as, cond_equal);
+    move(as, reg_rsi, reg_rdx);
+    arithmetic(as, alu_and, reg_rsi, reg_rcx);
+    arithmetic(as, alu_cmp, reg_rsi, reg_rcx);
+    size_t bits_b = jump_forward_if(as, cond_equal);
+    sse_memory(as, prefix_double, sse_load, 0, reg_sp, top - 2 * value_size);
+    sse_memory(as, prefix_double, sse_load, 1, reg_sp, top - value_size);
+#else
+    load_numbers(as, top, instruction);
+#endif
+    clear_eax(as);
+    sse_register(as, prefix_operand, sse_ucomis, 0, 1);
+    size_t unordered = jump_forward_if(as, cond_parity);
+    set_condition(as, cond_equal);
+    patch_here(as, unordered);
+#ifdef NAN_BOXING
+    size_t done = jump_forward(as);
+    patch_here(as, bits_a);
+    patch_here(as, bits_b);
+    arithmetic(as, alu_cmp, reg_rax, reg_rdx);
+    size_t same = jump_forward_if(as, cond_equal);
+    move_immediate(as, reg_rcx, sign_bit() | qnan());
+    arithmetic(as, alu_and, reg_rax, reg_rcx);
+    arithmetic(as, alu_and, reg_rdx, reg_rcx);
+    arithmetic(as, alu_and, reg_rax, reg_rdx);
+    arithmetic(as, alu_cmp, reg_rax, reg_rcx);
+    exit_if(as, cond_equal, instruction);
+    clear_eax(as);
+    size_t differ = jump_forward(as);
+    patch_here(as, same);
+    set_eax(as, 1);
+    patch_here(as, differ);
+    patch_here(as, done);
+#endif
+    store_bool(as, top - 2 * value_size);
+    add_immediate(as, reg_sp, top - value_size);
+}
+
+static void not_op(Assembler* as)
+{
+    size_t falsey[2];
+    int count = branch_if_falsey(as, -value_size, falsey);
+    clear_eax(as);
+    size_t done = jump_forward(as);
+    for (int i = 0; i < count; i++)
+    {
+        patch_here(as, falsey[i]);
+    }
+    set_eax(as, 1);
+    patch_here(as, done);
+    store_bool(as, -value_size);
+}
+
+static void negate_op(Assembler* as, int instruction)
+{
+    guard_number(as, -value_size, instruction);
+    load(as, reg_rax, reg_sp, -value_size + number_offset);
+    move_immediate(as, reg_rcx, 0x8000000000000000ull);
+    arithmetic(as, alu_xor, reg_rax, reg_rcx);
+    store(as, reg_sp, -value_size + number_offset, reg_rax);
+}
+
+static void copy_operands(Assembler* as, const uint8_t* code, bool constant)
+{
+    copy_value(as, reg_sp, 0, reg_slots, code[1] * value_size);
+    if (constant)
+    {
+        store_value(as, reg_sp, value_size, as->chunk->constants.values[code[2]]);
+    }
+    else
+    {
+        copy_value(as, reg_sp, value_size, reg_slots, code[2] * value_size);
+    }
+}
+
+static void load_upvalue(Assembler* as, int slot)
+{
+    load(as, reg_rdx, reg_frame, (int32_t)offsetof(Call_frame, closure));
+    load(as, reg_rdx, reg_rdx, (int32_t)offsetof(Closure, upvalues));
+    load(as, reg_rdx, reg_rdx, slot * (int32_t)sizeof(Upvalue*));
+    load(as, reg_rdx, reg_rdx, (int32_t)offsetof(Upvalue, location));
+}
+
+static void load_globals(Assembler* as)
+{
+    move_immediate(as, reg_rdx, (uint64_t)(uintptr_t)&vm.globals.values);
+    load(as, reg_rdx, reg_rdx, 0);
+}
+
+static void prologue(Assembler* as)
+{
+    push_register(as, reg_sp);
+    push_register(as, reg_slots);
+    push_register(as, reg_frame);
+    move(as, reg_frame, reg_rdi);
+    move_immediate(as, reg_rax, (uint64_t)(uintptr_t)&vm.stack_top);
+    load(as, reg_sp, reg_rax, 0);
+    load(as, reg_slots, reg_frame, (int32_t)offsetof(Call_frame, slots));
+    rex(as, false, 0, reg_rsi);
+    emit(as, 0xff);
+    register_operand(as, 4, reg_rsi);
+}
+
+// Every exit arrives here with the bytecode address to resume at in rax.
+static void exit_stub(Assembler* as)
+{
+    as->exit_stub = as->count;
+    store(as, reg_frame, (int32_t)offsetof(Call_frame, ip), reg_rax);
+    move_immediate(as, reg_rax, (uint64_t)(uintptr_t)&vm.stack_top);
+    store(as, reg_rax, 0, reg_sp);
+    pop_register(as, reg_frame);
+    pop_register(as, reg_slots);
+    pop_register(as, reg_sp);
+    emit(as, 0xc3);
+}
+
+static int read_short(Chunk* chunk, int offset)
+{
+    return (chunk->code[offset] << 8) | chunk->code[offset + 1];
+}
+
+static int instruction_length(Chunk* chunk, int offset)
+{
+    int length;
+    switch (chunk->code[offset])
+    {
+    case op_constant:
+    case op_get_local:
+    case op_set_local:
+    case op_get_upvalue:
+    case op_set_upvalue:
+    case op_get_super:
+    case op_method:
+    case op_call:
+    case op_tail_call:
+    case op_class:
+        length = 2;
+        break;
+    case op_pop_local:
+        length = 2;
+        break;
+    case op_get_global:
+    case op_define_global:
+    case op_set_global:
+    case op_jump:
+    case op_jump_if_false:
+    case op_loop:
+    case op_super_invoke:
+    case op_tail_super_invoke:
+    case op_equal_locals:
+    case op_greater_locals:
+    case op_less_locals:
+    case op_add_locals:
+    case op_subtract_locals:
+    case op_multiply_locals:
+    case op_divide_locals:
+    case op_equal_constant:
+    case op_greater_constant:
+    case op_less_constant:
+    case op_add_constant:
+    case op_subtract_constant:
+    case op_multiply_constant:
+    case op_divide_constant:
+        length = 3;
+        break;
+    case op_get_property:
+    case op_set_property:
+        length = 4;
+        break;
+    case op_invoke:
+    case op_tail_invoke:
+        length = 5;
+        break;
+    case op_closure:
+    {
+        Function* function = as_function(chunk->constants.values[chunk->code[offset + 1]]);
+        length = 2 + 2 * function->upvalue_count;
+        break;
+    }
+    default:
+        length = 1;
+        break;
+    }
+    return length;
+}
+
+static void translate(Assembler* as, int offset)
+{
+    Chunk* chunk = as->chunk;
+    uint8_t* code = chunk->code + offset;
+    switch (code[0])
+    {
+    case op_constant:
+        push_value(as, chunk->constants.values[code[1]]);
+        break;
+    case op_nil:
+        push_value(as, nil_value());
+        break;
+    case op_true:
+        push_value(as, bool_value(true));
+        break;
+    case op_false:
+        push_value(as, bool_value(false));
+        break;
+    case op_pop:
+        add_immediate(as, reg_sp, -value_size);
+        break;
+    case op_get_local:
+        copy_value(as, reg_sp, 0, reg_slots, code[1] * value_size);
+        add_immediate(as, reg_sp, value_size);
+        break;
+    case op_set_local:
+        copy_value(as, reg_slots, code[1] * value_size, reg_sp, -value_size);
+        break;
+    // Upvalue stores go through the interpreter for the write barrier.
+    case op_get_upvalue:
+        load_upvalue(as, code[1]);
+        copy_value(as, reg_sp, 0, reg_rdx, 0);
+        add_immediate(as, reg_sp, value_size);
+        break;
+    case op_get_global:
+    {
+        int32_t slot = read_short(chunk, offset + 1) * value_size;
+        load_globals(as);
+        guard_defined(as, reg_rdx, slot, offset);
+        copy_value(as, reg_sp, 0, reg_rdx, slot);
+        add_immediate(as, reg_sp, value_size);
+        break;
+    }
+    case op_define_global:
+        load_globals(as);
+        copy_value(as, reg_rdx, read_short(chunk, offset + 1) * value_size, reg_sp, -value_size);
+        add_immediate(as, reg_sp, -value_size);
+        break;
+    case op_set_global:
+    {
+        int32_t slot = read_short(chunk, offset + 1) * value_size;
+        load_globals(as);
+        guard_defined(as, reg_rdx, slot, offset);
+        copy_value(as, reg_rdx, slot, reg_sp, -value_size);
+        break;
+    }
+    case op_equal:
+        equal_op(as, 0, offset);
+        break;
+    case op_greater:
+    case op_greater_number:
+        compare_op(as, true, 0, offset);
+        break;
+    case op_less:
+    case op_less_number:
+        compare_op(as, false, 0, offset);
+        break;
+    case op_add:
+    case op_add_number:
+        number_op(as, sse_add, 0, offset);
+        break;
+    case op_subtract:
+    case op_subtract_number:
+        number_op(as, sse_subtract, 0, offset);
+        break;
+    case op_multiply:
+    case op_multiply_number:
+        number_op(as, sse_multiply, 0, offset);
+        break;
+    case op_divide:
+    case op_divide_number:
+        number_op(as, sse_divide, 0, offset);
+        break;
+    case op_equal_locals:
+    case op_equal_constant:
+        copy_operands(as, code, code[0] == op_equal_constant);
+        equal_op(as, 2 * value_size, offset);
+        break;
+    case op_greater_locals:
+    case op_greater_constant:
+        copy_operands(as, code, code[0] == op_greater_constant);
+        compare_op(as, true, 2 * value_size, offset);
+        break;
+    case op_less_locals:
+    case op_less_constant:
+        copy_operands(as, code, code[0] == op_less_constant);
+        compare_op(as, false, 2 * value_size, offset);
+        break;
+    case op_add_locals:
+    case op_add_constant:
+        copy_operands(as, code, code[0] == op_add_constant);
+        number_op(as, sse_add, 2 * value_size, offset);
+        break;
+    case op_subtract_locals:
+    case op_subtract_constant:
+        copy_operands(as, code, code[0] == op_subtract_constant);
+        number_op(as, sse_subtract, 2 * value_size, offset);
+        break;
+    case op_multiply_locals:
+    case op_multiply_constant:
+        copy_operands(as, code, code[0] == op_multiply_constant);
+        number_op(as, sse_multiply, 2 * value_size, offset);
+        break;
+    case op_divide_locals:
+    case op_divide_constant:
+        copy_operands(as, code, code[0] == op_divide_constant);
+        number_op(as, sse_divide, 2 * value_size, offset);
+        break;
+    case op_pop_local:
+        copy_value(as, reg_slots, code[1] * value_size, reg_sp, -value_size);
+        add_immediate(as, reg_sp, -value_size);
+        break;
+    case op_not:
+        not_op(as);
+        break;
+    case op_negate:
+        negate_op(as, offset);
+        break;
+    case op_jump:
+        jump_to(as, offset + 3 + read_short(chunk, offset + 1));
+        break;
+    case op_jump_if_false:
+    {
+        size_t falsey[2];
+        int count = branch_if_falsey(as, -value_size, falsey);
+        for (int i = 0; i < count; i++)
+        {
+            add_patch(&as->jumps, &as->jump_count, &as->jump_capacity, falsey[i],
+                offset + 3 + read_short(chunk, offset + 1));
+        }
+        break;
+    }
+    case op_loop:
+        jump_to(as, offset + 3 - read_short(chunk, offset + 1));
+        break;
+    default:
+        exit_at(as, offset);
+        break;
+    }
+}
+
+static void* map_pages(size_t size)
+{
+    void* pages = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    return pages == MAP_FAILED ? NULL : pages;
+}
+
+static Jit_block* find_mapping(Jit_arena* arena, uint8_t* start)
+{
+    Jit_block* mapping = arena->mappings;
+    while (start < mapping->start || start >= mapping->start + mapping->size)
+    {
+        mapping = mapping->next;
+    }
+    return mapping;
+}
+
+static bool arena_allocate(Jit_arena* arena, size_t size, Jit_block* block)
+{
+    size = (size + 15) & ~(size_t)15;
+    Jit_block** link = &arena->free;
+    while (*link != NULL && (*link)->size < size)
+    {
+        link = &(*link)->next;
+    }
+    bool allocated = true;
+    if (*link != NULL)
+    {
+        Jit_block* free_block = *link;
+        block->start = free_block->start;
+        block->size = size;
+        free_block->start += size;
+        free_block->size -= size;
+        if (free_block->size == 0)
+        {
+            *link = free_block->next;
+            free(free_block);
+        }
+    }
+    else
+    {
+        if (arena->top == NULL || (size_t)(arena->end - arena->top) < size)
+        {
+            size_t mapping_size = size > jit_arena_size ? size : jit_arena_size;
+            uint8_t* pages = (uint8_t*)map_pages(mapping_size);
+            if (pages == NULL)
+            {
+                allocated = false;
+            }
+            else
+            {
+                Jit_block* mapping = (Jit_block*)grow(NULL, sizeof(Jit_block));
+                mapping->start = pages;
+                mapping->size = mapping_size;
+                mapping->next = arena->mappings;
+                arena->mappings = mapping;
+                mprotect(pages, mapping_size, PROT_READ | PROT_EXEC);
+                arena->top = pages;
+                arena->end = pages + mapping_size;
+            }
+        }
+        if (allocated)
+        {
+            block->start = arena->top;
+            block->size = size;
+            arena->top += size;
+        }
+    }
+    return allocated;
+}
+
+static void arena_write(Jit_arena* arena, Jit_block* block, uint8_t* code, size_t count)
+{
+    // Mappings stay executable but not writable except while code is being
+    // copied in. No compiled code is running at that point: native code
+    // always returns to the interpreter before anything can be compiled.
+    Jit_block* mapping = find_mapping(arena, block->start);
+    mprotect(mapping->start, mapping->size, PROT_READ | PROT_WRITE);
+    memcpy(block->start, code, count);
+    mprotect(mapping->start, mapping->size, PROT_READ | PROT_EXEC);
+}
+
+void init_jit_arena(Jit_arena* arena)
+{
+    arena->mappings = NULL;
+    arena->free = NULL;
+    arena->top = NULL;
+    arena->end = NULL;
+}
+
+void free_jit_arena(Jit_arena* arena)
+{
+    while (arena->free != NULL)
+    {
+        Jit_block* next = arena->free->next;
+        free(arena->free);
+        arena->free = next;
+    }
+    while (arena->mappings != NULL)
+    {
+        Jit_block* next = arena->mappings->next;
+        munmap(arena->mappings->start, arena->mappings->size);
+        free(arena->mappings);
+        arena->mappings = next;
+    }
+    init_jit_arena(arena);
+}
+
+void jit_compile(Function* function)
+{
+    Chunk* chunk = &function->chunk;
+    Assembler as = {.chunk = chunk};
+    as.offsets = (int*)grow(NULL, sizeof(int) * (chunk->count + 1));
+    for (int i = 0; i < chunk->count; i++)
+    {
+        as.offsets[i] = -1;
+    }
+
+    prologue(&as);
+    exit_stub(&as);
+    int offset = 0;
+    while (offset < chunk->count)
+    {
+        as.offsets[offset] = (int)as.count;
+        translate(&as, offset);
+        offset += instruction_length(chunk, offset);
+    }
+    for (int i = 0; i < as.jump_count; i++)
+    {
+        patch(&as, as.jumps[i].at, (size_t)as.offsets[as.jumps[i].target]);
+    }
+    for (int i = 0; i < as.exit_count; i++)
+    {
+        patch_here(&as, as.exits[i].at);
+        exit_at(&as, as.exits[i].target);
+    }
+
+    Jit_code* jit = (Jit_code*)grow(NULL, sizeof(Jit_code));
+    if (arena_allocate(&vm.jit_arena, as.count, &jit->block))
+    {
+        arena_write(&vm.jit_arena, &jit->block, as.code, as.count);
+        jit->enter = (void (*)(Call_frame*, void*))(void*)jit->block.start;
+        jit->count = chunk->count;
+        jit->entries = (void**)grow(NULL, sizeof(void*) * chunk->count);
+        for (int i = 0; i < chunk->count; i++)
+        {
+            jit->entries[i] = as.offsets[i] == -1 ? NULL : jit->block.start + as.offsets[i];
+        }
+        function->jit = jit;
+    }
+    else
+    {
+        // Out of executable memory; stay interpreted.
+        free(jit);
+        function->hotness = INT_MIN;
+    }
+    free(as.code);
+    free(as.offsets);
+    free(as.jumps);
+    free(as.exits);
+}
+
+void jit_free(Jit_code* code)
+{
+    Jit_block* block = (Jit_block*)grow(NULL, sizeof(Jit_block));
+    *block = code->block;
+    block->next = vm.jit_arena.free;
+    vm.jit_arena.free = block;
+    free(code->entries);
+    free(code);
+}
+
+#endif
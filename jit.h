@@ -0,0 +1,54 @@
+#ifndef clox_jit
+#define clox_jit
+
+#include <stddef.h>
+#include <stdint.h>
+
+#if defined(JIT) && !(defined(__x86_64__) && defined(__unix__))
+#error "JIT requires an x86-64 POSIX target."
+#endif
+
+typedef struct Call_frame Call_frame;
+typedef struct Function Function;
+
+enum Jit_parameter
+{
+    jit_hot_threshold = 1000,
+    jit_arena_size = 64 * 1024
+};
+
+typedef struct Jit_block
+{
+    uint8_t* start;
+    size_t size;
+    struct Jit_block* next;
+} Jit_block;
+
+// Executable memory for compiled functions. Code is carved out of large
+// mappings by bump allocation and blocks released with their function are
+// reused first-fit.
+typedef struct
+{
+    Jit_block* mappings;
+    Jit_block* free;
+    uint8_t* top;
+    uint8_t* end;
+} Jit_arena;
+
+// Native code for one function. entries maps each bytecode offset that
+// starts an instruction to its native address, so the interpreter can
+// enter compiled code at any instruction boundary.
+typedef struct Jit_code
+{
+    void (*enter)(Call_frame* frame, void* target);
+    void** entries;
+    int count;
+    Jit_block block;
+} Jit_code;
+
+void init_jit_arena(Jit_arena* arena);
+void free_jit_arena(Jit_arena* arena);
+void jit_compile(Function* function);
+void jit_free(Jit_code* code);
+
+#endif
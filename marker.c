@@ -0,0 +1,382 @@
+// pthreads and sched_yield() are POSIX, not part of strict C11 builds.
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "marker.h"
+#include "object.h"
+
+#ifdef PARALLEL_GC
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <unistd.h>
+
+enum Marker_parameter
+{
+    marker_deque_capacity = 1024
+};
+
+typedef struct Gray_buffer
+{
+    int64_t capacity;
+    struct Gray_buffer* retired;
+    _Atomic(Object*) objects[];
+} Gray_buffer;
+
+// A Chase-Lev work-stealing deque. Only the owner pushes and takes at the
+// bottom; thieves take from the top. Buffers outgrown while thieves may
+// still read them are kept until marking ends.
+typedef struct
+{
+    _Atomic int64_t top;
+    _Atomic int64_t bottom;
+    _Atomic(Gray_buffer*) buffer;
+} Gray_deque;
+
+typedef struct
+{
+    Gray_deque deque;
+    pthread_t thread;
+    unsigned generation;
+    uint32_t seed;
+} Marker;
+
+typedef struct
+{
+    Marker* markers;
+    int count;
+    pthread_mutex_t lock;
+    pthread_cond_t start;
+    pthread_cond_t done;
+    unsigned generation;
+    int running;
+    bool quit;
+    atomic_int idle;
+    void (*blacken)(Object*);
+} Marker_pool;
+
+static Marker_pool pool = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .start = PTHREAD_COND_INITIALIZER,
+    .done = PTHREAD_COND_INITIALIZER
+};
+
+static _Thread_local Marker* current = NULL;
+
+static void* checked(void* pointer)
+{
+    if (pointer == NULL)
+    {
+        exit(1);
+    }
+    return pointer;
+}
+
+static Gray_buffer* new_buffer(int64_t capacity, Gray_buffer* retired)
+{
+    Gray_buffer* buffer =
+        (Gray_buffer*)checked(malloc(sizeof(Gray_buffer) + sizeof(Object*) * capacity));
+    buffer->capacity = capacity;
+    buffer->retired = retired;
+    return buffer;
+}
+
+static void init_deque(Gray_deque* deque)
+{
+    atomic_init(&deque->top, 0);
+    atomic_init(&deque->bottom, 0);
+    atomic_init(&deque->buffer, new_buffer(marker_deque_capacity, NULL));
+}
+
+// Frees the buffers the deque outgrew during the last marking.
+static void release_retired(Gray_deque* deque)
+{
+    Gray_buffer* buffer = atomic_load_explicit(&deque->buffer, memory_order_relaxed);
+    Gray_buffer* retired = buffer->retired;
+    buffer->retired = NULL;
+    while (retired != NULL)
+    {
+        Gray_buffer* next = retired->retired;
+        free(retired);
+        retired = next;
+    }
+}
+
+static void free_deque(Gray_deque* deque)
+{
+    release_retired(deque);
+    free(atomic_load_explicit(&deque->buffer, memory_order_relaxed));
+}
+
+static Gray_buffer* grow_deque(Gray_deque* deque, Gray_buffer* buffer, int64_t top, int64_t bottom)
+{
+    Gray_buffer* grown = new_buffer(buffer->capacity * 2, buffer);
+    for (int64_t i = top; i < bottom; i++)
+    {
+        Object* object =
+            atomic_load_explicit(&buffer->objects[i % buffer->capacity], memory_order_relaxed);
+        atomic_store_explicit(&grown->objects[i % grown->capacity], object, memory_order_relaxed);
+    }
+    atomic_store_explicit(&deque->buffer, grown, memory_order_release);
+    return grown;
+}
+
+static void push(Gray_deque* deque, Object* object)
+{
+    int64_t bottom = atomic_load_explicit(&deque->bottom, memory_order_relaxed);
+    int64_t top = atomic_load_explicit(&deque->top, memory_order_acquire);
+    Gray_buffer* buffer = atomic_load_explicit(&deque->buffer, memory_order_relaxed);
+    if (bottom - top > buffer->capacity - 1)
+    {
+        buffer = grow_deque(deque, buffer, top, bottom);
+    }
+    atomic_store_explicit(&buffer->objects[bottom % buffer->capacity], object, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_relaxed);
+}
+
+static Object* take(Gray_deque* deque)
+{
+    int64_t bottom = atomic_load_explicit(&deque->bottom, memory_order_relaxed) - 1;
+    Gray_buffer* buffer = atomic_load_explicit(&deque->buffer, memory_order_relaxed);
+    atomic_store_explicit(&deque->bottom, bottom, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    int64_t top = atomic_load_explicit(&deque->top, memory_order_relaxed);
+    Object* object = NULL;
+    if (top <= bottom)
+    {
+        object = atomic_load_explicit(&buffer->objects[bottom % buffer->capacity],
+            memory_order_relaxed);
+        if (top == bottom)
+        {
+            // The last object; race any thief for it.
+            if (!atomic_compare_exchange_strong_explicit(&deque->top, &top, top + 1,
+                    memory_order_seq_cst, memory_order_relaxed))
+            {
+                object = NULL;
+            }
+            atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_relaxed);
+        }
+    }
+    else
+    {
+        atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_relaxed);
+    }
+    return object;
+}
+
+static Object* steal(Gray_deque* deque)
+{
+    int64_t top = atomic_load_explicit(&deque->top, memory_order_acquire);
+    atomic_thread_fence(memory_order_seq_cst);
+    int64_t bottom = atomic_load_explicit(&deque->bottom, memory_order_acquire);
+    Object* object = NULL;
+    if (top < bottom)
+    {
+        Gray_buffer* buffer = atomic_load_explicit(&deque->buffer, memory_order_acquire);
+        object = atomic_load_explicit(&buffer->objects[top % buffer->capacity],
+            memory_order_relaxed);
+        if (!atomic_compare_exchange_strong_explicit(&deque->top, &top, top + 1,
+                memory_order_seq_cst, memory_order_relaxed))
+        {
+            object = NULL;
+        }
+    }
+    return object;
+}
+
+static bool is_empty(Gray_deque* deque)
+{
+    int64_t top = atomic_load_explicit(&deque->top, memory_order_acquire);
+    int64_t bottom = atomic_load_explicit(&deque->bottom, memory_order_acquire);
+    return top >= bottom;
+}
+
+// Tries every other marker once, starting at a random one.
+static Object* steal_any(Marker* thief)
+{
+    Object* object = NULL;
+    thief->seed ^= thief->seed << 13;
+    thief->seed ^= thief->seed >> 17;
+    thief->seed ^= thief->seed << 5;
+    int first = (int)(thief->seed % (uint32_t)pool.count);
+    for (int i = 0; i < pool.count && object == NULL; i++)
+    {
+        Marker* victim = &pool.markers[(first + i) % pool.count];
+        if (victim != thief)
+        {
+            object = steal(&victim->deque);
+        }
+    }
+    return object;
+}
+
+static bool any_work()
+{
+    bool found = false;
+    for (int i = 0; i < pool.count && !found; i++)
+    {
+        found = !is_empty(&pool.markers[i].deque);
+    }
+    return found;
+}
+
+// Blackens objects until every marker has run dry. A marker only goes idle
+// with an empty deque and nobody pushes onto another marker's deque, so once
+// all of them are idle no work is left anywhere.
+static void drain(Marker* marker)
+{
+    bool done = false;
+    while (!done)
+    {
+        Object* object = take(&marker->deque);
+        if (object == NULL)
+        {
+            object = steal_any(marker);
+        }
+        if (object != NULL)
+        {
+            pool.blacken(object);
+        }
+        else
+        {
+            atomic_fetch_add(&pool.idle, 1);
+            while (!done && !any_work())
+            {
+                done = atomic_load(&pool.idle) == pool.count;
+                sched_yield();
+            }
+            if (!done)
+            {
+                atomic_fetch_sub(&pool.idle, 1);
+            }
+        }
+    }
+}
+
+static void* run_marker(void* argument)
+{
+    Marker* marker = (Marker*)argument;
+    current = marker;
+    pthread_mutex_lock(&pool.lock);
+    for (;;)
+    {
+        while (pool.generation == marker->generation && !pool.quit)
+        {
+            pthread_cond_wait(&pool.start, &pool.lock);
+        }
+        if (pool.quit)
+        {
+            break;
+        }
+        marker->generation = pool.generation;
+        pthread_mutex_unlock(&pool.lock);
+        drain(marker);
+        pthread_mutex_lock(&pool.lock);
+        if (--pool.running == 0)
+        {
+            pthread_cond_signal(&pool.done);
+        }
+    }
+    pthread_mutex_unlock(&pool.lock);
+    return NULL;
+}
+
+// Marker 0 is the calling thread; the others get threads of their own.
+static void start_markers(int count)
+{
+    pool.markers = (Marker*)checked(calloc((size_t)count, sizeof(Marker)));
+    pool.count = count;
+    pool.quit = false;
+    for (int i = 0; i < count; i++)
+    {
+        init_deque(&pool.markers[i].deque);
+        pool.markers[i].generation = pool.generation;
+        pool.markers[i].seed = (uint32_t)i + 1;
+    }
+    for (int i = 1; i < count; i++)
+    {
+        if (pthread_create(&pool.markers[i].thread, NULL, run_marker, &pool.markers[i]) != 0)
+        {
+            exit(1);
+        }
+    }
+}
+
+int online_processors()
+{
+    long count = sysconf(_SC_NPROCESSORS_ONLN);
+    return count < 1 ? 1 : (int)count;
+}
+
+bool parallel_marking()
+{
+    return current != NULL;
+}
+
+void push_gray(Object* object)
+{
+    push(&current->deque, object);
+}
+
+void mark_in_parallel(int count, Object** grays, int gray_count, void (*blacken)(Object*))
+{
+    if (pool.count != count)
+    {
+        free_markers();
+        start_markers(count);
+    }
+    for (int i = 0; i < gray_count; i++)
+    {
+        push(&pool.markers[i % count].deque, grays[i]);
+    }
+    pool.blacken = blacken;
+    atomic_store(&pool.idle, 0);
+
+    pthread_mutex_lock(&pool.lock);
+    pool.running = count - 1;
+    pool.generation++;
+    pthread_cond_broadcast(&pool.start);
+    pthread_mutex_unlock(&pool.lock);
+
+    current = &pool.markers[0];
+    drain(current);
+    current = NULL;
+
+    pthread_mutex_lock(&pool.lock);
+    while (pool.running > 0)
+    {
+        pthread_cond_wait(&pool.done, &pool.lock);
+    }
+    pthread_mutex_unlock(&pool.lock);
+    for (int i = 0; i < count; i++)
+    {
+        release_retired(&pool.markers[i].deque);
+    }
+}
+
+void free_markers()
+{
+    pthread_mutex_lock(&pool.lock);
+    pool.quit = true;
+    pthread_cond_broadcast(&pool.start);
+    pthread_mutex_unlock(&pool.lock);
+    for (int i = 1; i < pool.count; i++)
+    {
+        pthread_join(pool.markers[i].thread, NULL);
+    }
+    for (int i = 0; i < pool.count; i++)
+    {
+        free_deque(&pool.markers[i].deque);
+    }
+    free(pool.markers);
+    pool.markers = NULL;
+    pool.count = 0;
+}
+
+#endif
@@ -0,0 +1,22 @@
+#ifndef clox_marker
+#define clox_marker
+
+#include <stdbool.h>
+
+#include "object.h"
+
+#ifdef PARALLEL_GC
+
+// Marking on several threads at once. Each marker owns a deque of gray
+// objects: it pushes and pops at one end while idle markers steal from the
+// other, so work spreads out as the traced graph fans out.
+
+int online_processors();
+bool parallel_marking();
+void push_gray(Object* object);
+void mark_in_parallel(int count, Object** grays, int gray_count, void (*blacken)(Object*));
+void free_markers();
+
+#endif
+
+#endif
@@ -1,40 +1,66 @@
 #include <malloc.h>
 #include <stdbool.h>
 #include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 
 #include "compiler.h"
+#include "heap.h"
+#include "marker.h"
 #include "memory.h"
 #include "object.h"
+#include "sweeper.h"
 #include "table.h"
 #include "value.h"
 #include "vm.h"
 
 #ifdef DEBUG_LOG_GC
-#include <stdio.h>
 #include "debug.h"
 #endif
 
 enum GC_parameter
 {
-    gc_heap_grow_factor = 2
+    gc_nursery_size = 256 * 1024,
+    gc_step_size = 8 * 1024,
+    gc_min_step_size = 1024,
+    gc_sweep_slice = 1024,
+    gc_min_budget = 64,
+    gc_max_budget = 1 << 20,
+    gc_stress_major_interval = 8
 };
 
-static void* reallocate(void* pointer, size_t old, size_t new)
+static void collect_if_needed();
+#ifdef DEBUG_STRESS_GC
+static void stress_garbage_collector();
+#endif
+
+// Accounts for memory about to change hands and collects if that takes the
+// heap past a threshold.
+static void track(size_t old, size_t new)
 {
-    (void)old;
+#ifdef PARALLEL_GC
+    if (on_sweeper_thread())
+    {
+        count_swept(old);
+    }
+    else
+#endif
     vm.bytes_allocated += new - old;
-    void* result;
     if (new > old)
     {
+        vm.total_allocated += new - old;
 #ifdef DEBUG_STRESS_GC
-        collect_garbage();
+        stress_garbage_collector();
 #endif
-        if (vm.bytes_allocated > vm.next_GC)
-        {
-            collect_garbage();
-        }
+        collect_if_needed();
     }
+}
+
+static void* resize(void* pointer, size_t new)
+{
+    void* result;
     if (new == 0)
     {
         free(pointer);
@@ -51,61 +77,88 @@ static void* reallocate(void* pointer, size_t old, size_t new)
     return result;
 }
 
+static void* reallocate(void* pointer, size_t old, size_t new)
+{
+    track(old, new);
+    return resize(pointer, new);
+}
+
 static void free_object(Object* object)
 {
 #ifdef DEBUG_LOG_GC
-    printf("%p free type %d\n", (void*)object, object->type);
+    printf("%p free type %d\n", (void*)object, type_of(object));
 #endif
-    switch (object->type)
+    switch (type_of(object))
     {
     case obj_class:
     {
         Class* class = (Class*)object;
         free_table(&class->methods);
-        reallocate(object, sizeof(Class), 0);
+        free_cell(object, sizeof(Class));
         break;
     }
     case obj_bound_method:
     {
-        reallocate(object, sizeof(Bound_method), 0);
+        free_cell(object, sizeof(Bound_method));
         break;
     }
     case obj_upvalue:
     {
-        reallocate(object, sizeof(Upvalue), 0);
+        free_cell(object, sizeof(Upvalue));
         break;
     }
     case obj_closure:
     {
         Closure* closure = (Closure*)object;
         free_array_upvalues(closure->upvalues, closure->upvalue_count);
-        reallocate(object, sizeof(Closure), 0);
+        free_cell(object, sizeof(Closure));
         break;
     }
     case obj_function:
     {
         Function* function = (Function*)object;
         free_chunk(&function->chunk);
-        reallocate(object, sizeof(Function), 0);
+#ifdef JIT
+        if (function->jit != NULL)
+        {
+            jit_free(function->jit);
+        }
+#endif
+        free_cell(object, sizeof(Function));
         break;
     }
     case obj_instance:
     {
         Instance* instance = (Instance*)object;
-        free_table(&instance->fields);
-        reallocate(object, sizeof(Instance), 0);
+        free_array_value(instance->fields, instance->capacity);
+        free_table(&instance->dictionary);
+        free_cell(object, sizeof(Instance));
+        break;
+    }
+    case obj_shape:
+    {
+        Shape* shape = (Shape*)object;
+        free_table(&shape->transitions);
+        free_cell(object, sizeof(Shape));
         break;
     }
     case obj_native:
     {
-        reallocate(object, sizeof(Native), 0);
+        free_cell(object, sizeof(Native));
         break;
     }
     case obj_string:
     {
         String* string = (String*)object;
-        free_array_char(string->chars, string->length + 1);
-        reallocate(object, sizeof(String), 0);
+        if (string->interned)
+        {
+            table_delete(&vm.strings, string);
+        }
+        if (string->chars != NULL && string->chars != string->bytes)
+        {
+            free_array_char(string->chars, string->length + 1);
+        }
+        free_cell(object, string_size(string));
         break;
     }
     default:
@@ -118,6 +171,13 @@ char* allocate_char(int count)
     return (char*)reallocate(NULL, 0, sizeof(char) * count);
 }
 
+// Counts the memory but leaves any collection it calls for to the next
+// allocation, for callers holding objects no root reaches.
+char* allocate_char_deferred(int count)
+{
+    return (char*)allocate_void_deferred(sizeof(char) * count);
+}
+
 Entry* allocate_entry(int count)
 {
     return (Entry*)reallocate(NULL, 0, sizeof(Entry) * count);
@@ -133,6 +193,27 @@ void* allocate_void(size_t size)
     return reallocate(NULL, 0, size);
 }
 
+void* allocate_void_deferred(size_t size)
+{
+    vm.bytes_allocated += size;
+    vm.total_allocated += size;
+    return resize(NULL, size);
+}
+
+// Objects come from the VM's own heap rather than malloc. Those allocated
+// while a cycle sweeps are born marked, so the sweep leaves them alone.
+void* allocate_cell(size_t size)
+{
+    track(0, size);
+    return heap_allocate(&vm.heap, size, vm.gc_phase == gc_sweep);
+}
+
+void free_array_cache(Inline_cache* pointer, int count)
+{
+    size_t size = sizeof(Inline_cache) * count;
+    reallocate(pointer, size, 0);
+}
+
 void free_array_char(char* pointer, int count)
 {
     size_t size = sizeof(char) * count;
@@ -168,16 +249,66 @@ void free_array_value(Value* pointer, int count)
     reallocate(pointer, size, 0);
 }
 
-void free_objects()
+void free_cell(void* pointer, size_t size)
+{
+    track(size, 0);
+#ifdef PARALLEL_GC
+    if (on_sweeper_thread())
+    {
+        release_cell(pointer);
+    }
+    else
+#endif
+    heap_free(&vm.heap, pointer);
+}
+
+static void free_dead(void* cell)
+{
+    free_object((Object*)cell);
+}
+
+#ifdef PARALLEL_GC
+static void free_list(Object* object)
 {
-    Object* object = vm.objects;
     while (object != NULL)
     {
-        Object* next = object->next;
+        Object* next = next_object(object);
         free_object(object);
         object = next;
     }
+}
+
+// Takes back the cells the background sweeper freed. The dead objects it
+// left alone are freed here, on the interpreter's thread.
+static void join_background_sweep()
+{
+    Object* deferred;
+    size_t freed;
+    join_sweeper(&deferred, &freed, &vm.heap);
+    vm.bytes_allocated -= freed;
+    free_list(deferred);
+}
+#endif
+
+void free_objects()
+{
+#ifdef PARALLEL_GC
+    join_background_sweep();
+#endif
+    heap_clear_marks(&vm.heap);
+    for (Page* page = vm.heap.pages; page != NULL; page = page->next)
+    {
+        heap_sweep_page(page, free_dead);
+    }
     free(vm.gray_stack);
+    free(vm.remembered);
+}
+
+Inline_cache* grow_array_cache(Inline_cache* pointer, int old, int new)
+{
+    size_t old_size = sizeof(Inline_cache) * old;
+    size_t new_size = sizeof(Inline_cache) * new;
+    return (Inline_cache*)reallocate(pointer, old_size, new_size);
 }
 
 int* grow_array_int(int* pointer, int old, int new)
@@ -202,27 +333,92 @@ Value* grow_array_value(Value* pointer, int old, int new)
     return (Value*)reallocate(pointer, old_size, new_size);
 }
 
-void mark_object(Object* object)
+// Minor collections treat the whole old generation as live.
+bool is_white(Object* object)
+{
+    return !is_marked(object) && !(vm.minor_GC && is_old(object));
+}
+
+// Whatever is marked survives the collection and belongs to the old
+// generation from then on.
+static void gray_object(Object* object)
 {
-    if (object != NULL && !object->is_marked)
+    set_mark(object);
+    set_old(object);
+    if (vm.gray_capacity < vm.gray_count + 1)
     {
-#ifdef DEBUG_LOG_GC
-        printf("%p mark ", (void*)object);
-        print_value(object_value(object));
-        printf("\n");
+        vm.gray_capacity = grow_capacity(vm.gray_capacity);
+        Object** grays = (Object**)realloc(vm.gray_stack, sizeof(Object*) * vm.gray_capacity);
+        if (grays == NULL)
+        {
+            exit(1);
+        }
+        vm.gray_stack = grays;
+    }
+    vm.gray_stack[vm.gray_count++] = object;
+}
+
+#ifdef PARALLEL_GC
+// Several markers can reach the same object at once; only the one that
+// flips its mark bit traces it.
+static bool claim(Object* object)
+{
+    bool claimed = false;
+    if (!(vm.minor_GC && is_old(object)) && claim_mark(object))
+    {
+        set_old(object);
+        claimed = true;
+    }
+    return claimed;
+}
 #endif
-        object->is_marked = true;
-        if (vm.gray_capacity < vm.gray_count + 1)
+
+void mark_object(Object* object)
+{
+    if (object != NULL)
+    {
+#ifdef PARALLEL_GC
+        if (parallel_marking())
         {
-            vm.gray_capacity = grow_capacity(vm.gray_capacity);
-            Object** grays = (Object**)realloc(vm.gray_stack, sizeof(Object*) * vm.gray_capacity);
-            if (grays == NULL)
+            if (claim(object))
             {
-                exit(1);
+                push_gray(object);
             }
-            vm.gray_stack = grays;
         }
-        vm.gray_stack[vm.gray_count++] = object;
+        else
+#endif
+        if (is_white(object))
+        {
+#ifdef DEBUG_LOG_GC
+            printf("%p mark ", (void*)object);
+            print_value(object_value(object));
+            printf("\n");
+#endif
+            gray_object(object);
+        }
+    }
+}
+
+// Objects allocated while a cycle is marking start out gray, so whatever
+// they are given before marking finishes gets traced.
+void mark_new_object(Object* object)
+{
+    if (vm.gc_phase == gc_mark)
+    {
+        gray_object(object);
+    }
+}
+
+void write_barrier_table(Object* owner, Table* table)
+{
+    for (int i = 0; i < table->capacity; i++)
+    {
+        Entry* entry = &table->entries[i];
+        if (entry->key != NULL)
+        {
+            write_barrier_object(owner, (Object*)entry->key);
+            write_barrier(owner, entry->value);
+        }
     }
 }
 
@@ -234,6 +430,26 @@ void mark_value(Value value)
     }
 }
 
+void remember(Object* object)
+{
+    if (is_old(object) && !is_remembered(object))
+    {
+        set_remembered(object);
+        if (vm.remembered_capacity < vm.remembered_count + 1)
+        {
+            vm.remembered_capacity = grow_capacity(vm.remembered_capacity);
+            Object** remembered =
+                (Object**)realloc(vm.remembered, sizeof(Object*) * vm.remembered_capacity);
+            if (remembered == NULL)
+            {
+                exit(1);
+            }
+            vm.remembered = remembered;
+        }
+        vm.remembered[vm.remembered_count++] = object;
+    }
+}
+
 static void mark_array(Value_array* array)
 {
     for (int i = 0; i < array->count; i++)
@@ -242,6 +458,16 @@ static void mark_array(Value_array* array)
     }
 }
 
+static void mark_caches(Chunk* chunk)
+{
+    for (int i = 0; i < chunk->cache_count; i++)
+    {
+        mark_object((Object*)chunk->caches[i].shape);
+        mark_object((Object*)chunk->caches[i].method);
+        mark_object((Object*)chunk->caches[i].transition);
+    }
+}
+
 static void mark_roots()
 {
     for (Value* slot = vm.stack; slot < vm.stack_top; slot++)
@@ -256,7 +482,9 @@ static void mark_roots()
     {
         mark_object((Object*)uv);
     }
-    mark_table(&vm.globals);
+    mark_table(&vm.global_slots);
+    mark_array(&vm.global_names);
+    mark_array(&vm.globals);
     mark_compiler_roots();
     mark_object((Object*)vm.init_string);
 }
@@ -268,13 +496,14 @@ static void blacken_object(Object* object)
     print_value(object_value(object));
     printf("\n");
 #endif
-    switch (object->type)
+    switch (type_of(object))
     {
     case obj_class:
     {
         Class* class = (Class*)object;
         mark_object((Object*)class->name);
         mark_table(&class->methods);
+        mark_object((Object*)class->shape);
         break;
     }
     case obj_bound_method:
@@ -292,13 +521,30 @@ static void blacken_object(Object* object)
         Function* function = (Function*)object;
         mark_object((Object*)function->name);
         mark_array(&function->chunk.constants);
+        mark_caches(&function->chunk);
         break;
     }
     case obj_instance:
     {
         Instance* instance = (Instance*)object;
         mark_object((Object*)instance->class);
-        mark_table(&instance->fields);
+        if (instance->shape != NULL)
+        {
+            mark_object((Object*)instance->shape);
+            for (int i = 0; i < instance->shape->field_count; i++)
+            {
+                mark_value(instance->fields[i]);
+            }
+        }
+        mark_table(&instance->dictionary);
+        break;
+    }
+    case obj_shape:
+    {
+        Shape* shape = (Shape*)object;
+        mark_object((Object*)shape->parent);
+        mark_object((Object*)shape->name);
+        mark_table(&shape->transitions);
         break;
     }
     case obj_closure:
@@ -311,8 +557,17 @@ static void blacken_object(Object* object)
         }
         break;
     }
-    case obj_native:
     case obj_string:
+    {
+        String* string = (String*)object;
+        if (string->rope && string->chars == NULL)
+        {
+            mark_object((Object*)rope_left(string));
+            mark_object((Object*)rope_right(string));
+        }
+        break;
+    }
+    case obj_native:
     default:
         break;
     }
@@ -320,6 +575,13 @@ static void blacken_object(Object* object)
 
 static void trace_references()
 {
+#ifdef PARALLEL_GC
+    if (vm.gc_workers > 1 && vm.gray_count > 0)
+    {
+        mark_in_parallel(vm.gc_workers, vm.gray_stack, vm.gray_count, blacken_object);
+        vm.gray_count = 0;
+    }
+#endif
     while (vm.gray_count > 0)
     {
         Object* object = vm.gray_stack[--vm.gray_count];
@@ -327,49 +589,474 @@ static void trace_references()
     }
 }
 
-static void sweep()
+// Traces the young objects that remembered old objects point to.
+static void mark_remembered()
+{
+    for (int i = 0; i < vm.remembered_count; i++)
+    {
+        blacken_object(vm.remembered[i]);
+    }
+}
+
+static void forget_remembered()
+{
+    for (int i = 0; i < vm.remembered_count; i++)
+    {
+        clear_remembered(vm.remembered[i]);
+    }
+    vm.remembered_count = 0;
+}
+
+static double now()
+{
+    struct timespec time;
+    timespec_get(&time, TIME_UTC);
+    return (double)time.tv_sec + (double)time.tv_nsec / 1e9;
+}
+
+// Returns the seconds since *since and starts counting again from now.
+static double lap(double* since)
+{
+    double time = now();
+    double seconds = time - *since;
+    *since = time;
+    return seconds;
+}
+
+static void open_record(bool full)
 {
-    Object* previous = NULL;
-    Object* object = vm.objects;
+    memset(&vm.gc_record, 0, sizeof(GC_record));
+    vm.gc_record.full = full;
+    vm.gc_record.start = now() - vm.gc_epoch;
+    vm.gc_record.bytes_before = vm.bytes_allocated;
+    vm.cycle_start = vm.total_allocated;
+}
+
+static void close_record()
+{
+    vm.gc_record.bytes_allocated = vm.total_allocated - vm.cycle_start;
+    vm.gc_record.bytes_after = vm.bytes_allocated;
+    vm.gc_finished = true;
+}
+
+static void count_live(void* cell)
+{
+    vm.gc_record.live[type_of((Object*)cell)]++;
+}
+
+// Frees the unmarked objects of the young list and leaves the rest in the
+// old generation, which has no list: objects never move in memory, and the
+// old ones are found by walking the heap's pages.
+static void promote()
+{
+    Object* object = vm.young_objects;
     while (object != NULL)
     {
-        if (object->is_marked)
+        Object* next = next_object(object);
+        if (is_marked(object))
         {
-            object->is_marked = false;
-            previous = object;
-            object = object->next;
+            if (vm.gc_settings.census)
+            {
+                count_live(object);
+            }
+            clear_mark(object);
         }
         else
         {
-            Object* unreached = object;
-            object = object->next;
-            if (previous != NULL)
-            {
-                previous->next = object;
-            }
-            else
-            {
-                vm.objects = object;
-            }
-            free_object(unreached);
+            free_object(object);
         }
+        object = next;
     }
+    vm.young_objects = NULL;
 }
 
-void collect_garbage()
+// Sweeps the heap page by page from where the previous call stopped,
+// spending at most *budget objects. Returns true once every page has been
+// swept.
+static bool sweep(size_t* budget)
+{
+    while (vm.sweep != NULL && *budget > 0)
+    {
+        size_t freed = heap_sweep_page(vm.sweep, free_dead) + 1;
+        *budget = freed < *budget ? *budget - freed : 0;
+        vm.sweep = vm.sweep->next;
+    }
+    return vm.sweep == NULL;
+}
+
+// A minor collection traces from the roots and the remembered set only, so
+// its cost follows the surviving young objects rather than the whole heap.
+static void collect_young()
 {
 #ifdef DEBUG_LOG_GC
-    printf("-- gc begin\n");
+    printf("-- minor gc begin\n");
     size_t before = vm.bytes_allocated;
 #endif
+    open_record(false);
+    double since = now();
+    vm.minor_GC = true;
+    mark_roots();
+    mark_remembered();
+    trace_references();
+    vm.gc_record.mark_seconds += lap(&since);
+    promote();
+    forget_remembered();
+    table_compact(&vm.strings);
+    vm.minor_GC = false;
+    vm.next_minor_GC = vm.bytes_allocated + gc_nursery_size;
+    vm.gc_record.sweep_seconds += lap(&since);
+    close_record();
+#ifdef DEBUG_LOG_GC
+    printf("-- minor gc end\n");
+    printf("   collected %zu bytes (from %zu to %zu)\n", before - vm.bytes_allocated, before,
+        vm.bytes_allocated);
+#endif
+}
+
+// A full collection runs as a cycle of small steps interleaved with
+// allocation: the roots are grayed, the gray stack is drained a slice at a
+// time while write barriers gray whatever the mutator stores into marked
+// objects, and a final pause rescans the roots, which have no barrier.
+// Everything marked by then is old, so the young list is dropped, and the
+// heap's pages are swept a slice at a time, or by the background sweeper
+// when there are several GC workers. Minor collections wait until the cycle
+// is over.
+static void start_cycle()
+{
+#ifdef DEBUG_LOG_GC
+    printf("-- gc begin\n");
+#endif
+    open_record(true);
+    double since = now();
+    vm.gc_phase = gc_mark;
+    vm.gc_work = 0;
+    mark_roots();
+    vm.next_GC_step = vm.bytes_allocated + vm.gc_step_bytes;
+    vm.gc_record.mark_seconds += lap(&since);
+}
+
+// The census is taken before sweeping starts, since the background
+// sweeper would change the heap under it.
+static void finish_mark()
+{
+    double since = now();
     mark_roots();
     trace_references();
-    table_remove_white(&vm.strings);
-    sweep();
-    vm.next_GC = vm.bytes_allocated * gc_heap_grow_factor;
+    forget_remembered();
+    if (vm.gc_settings.census)
+    {
+        heap_visit_marked(&vm.heap, count_live);
+    }
+    vm.young_objects = NULL;
+    vm.sweep = vm.heap.pages;
+#ifdef PARALLEL_GC
+    if (vm.gc_workers > 1)
+    {
+        sweep_in_background(vm.sweep, free_object);
+        vm.sweep = NULL;
+    }
+#endif
+    vm.gc_phase = gc_sweep;
+    vm.gc_record.mark_seconds += lap(&since);
+}
+
+// Sizes the next cycle from what this one found. The goal follows the live
+// heap and the settings. The cycle starts early enough to finish by the goal
+// if the program allocates as much during it as during the last ones, and
+// its steps are spread so the work this cycle took fits in between.
+static void pace_next_cycle()
+{
+    GC_settings* settings = &vm.gc_settings;
+    size_t live = vm.bytes_allocated;
+    size_t goal = live + live / 100 * settings->heap_growth;
+    if (goal < settings->initial_heap)
+    {
+        goal = settings->initial_heap;
+    }
+    if (settings->memory_limit > live && goal > settings->memory_limit)
+    {
+        size_t least = live + (goal - live) / 4;
+        goal = settings->memory_limit > least ? settings->memory_limit : least;
+    }
+    if (goal < live + gc_nursery_size)
+    {
+        goal = live + gc_nursery_size;
+    }
+    size_t headroom = goal - live;
+    vm.gc_runway = (vm.gc_runway + (vm.total_allocated - vm.cycle_start)) / 2;
+    size_t room = vm.gc_runway + vm.gc_runway / 4;
+    if (room > headroom - headroom / 4)
+    {
+        room = headroom - headroom / 4;
+    }
+    vm.gc_goal = goal;
+    vm.next_GC = goal - room;
+    vm.gc_step_bytes = gc_step_size;
+    if (vm.gc_work > 0 && vm.gc_budget > 0)
+    {
+        vm.gc_step_bytes = room / (vm.gc_work / vm.gc_budget + 1);
+        if (vm.gc_step_bytes < gc_min_step_size)
+        {
+            vm.gc_step_bytes = gc_min_step_size;
+        }
+    }
+}
+
+static void finish_cycle()
+{
+    double since = now();
+    heap_clear_marks(&vm.heap);
+    heap_release_empty(&vm.heap);
+    vm.gc_phase = gc_idle;
+    table_compact(&vm.strings);
+    pace_next_cycle();
+    vm.next_minor_GC = vm.bytes_allocated + gc_nursery_size;
+    vm.gc_record.sweep_seconds += lap(&since);
+    close_record();
 #ifdef DEBUG_LOG_GC
     printf("-- gc end\n");
-    printf("   collected %zu bytes (from %zu to %zu) next at %zu\n", before - vm.bytes_allocated,
-        before, vm.bytes_allocated, vm.next_GC);
+    printf("   heap at %zu next at %zu goal %zu\n", vm.bytes_allocated, vm.next_GC, vm.gc_goal);
+#endif
+}
+
+// With no budget the marking is done in one pause and only sweeping is
+// spread over later steps.
+static void mark_atomically()
+{
+    start_cycle();
+    finish_mark();
+}
+
+static bool sweep_done(size_t* budget)
+{
+    bool done = sweep(budget);
+#ifdef PARALLEL_GC
+    if (done && background_sweep_done())
+    {
+        join_background_sweep();
+    }
+    else
+    {
+        done = false;
+    }
+#endif
+    return done;
+}
+
+// Scales the step budget toward the work that fits in the pause target at
+// the rate the last step achieved.
+static void fit_budget(size_t work, double seconds)
+{
+    if (vm.gc_settings.pause_target > 0 && vm.gc_budget > 0 && work > 0 && seconds > 0)
+    {
+        double fitting = (double)work * vm.gc_settings.pause_target / seconds;
+        double budget = ((double)vm.gc_budget + fitting) / 2;
+        if (budget < gc_min_budget)
+        {
+            budget = gc_min_budget;
+        }
+        if (budget > gc_max_budget)
+        {
+            budget = gc_max_budget;
+        }
+        vm.gc_budget = (size_t)budget;
+    }
+}
+
+// The final remark and the end of the cycle are not part of the timed
+// slice, as the budget can't shorten them.
+static void gc_step()
+{
+    size_t start = vm.gc_budget > 0 ? vm.gc_budget : gc_sweep_slice;
+    size_t budget = start;
+    double since = now();
+    while (vm.gc_phase == gc_mark && vm.gray_count > 0 && budget > 0)
+    {
+        blacken_object(vm.gray_stack[--vm.gray_count]);
+        budget--;
+    }
+    double seconds = lap(&since);
+    vm.gc_record.mark_seconds += seconds;
+    if (vm.gc_phase == gc_mark && vm.gray_count == 0)
+    {
+        finish_mark();
+    }
+    bool done = false;
+    if (vm.gc_phase == gc_sweep)
+    {
+        since = now();
+        done = sweep_done(&budget);
+        double swept = lap(&since);
+        vm.gc_record.sweep_seconds += swept;
+        seconds += swept;
+    }
+    vm.gc_work += start - budget;
+    fit_budget(start - budget, seconds);
+    if (done)
+    {
+        finish_cycle();
+    }
+    vm.next_GC_step = vm.bytes_allocated + vm.gc_step_bytes;
+}
+
+void collect_garbage()
+{
+    if (vm.gc_phase == gc_idle)
+    {
+        start_cycle();
+    }
+    if (vm.gc_phase == gc_mark)
+    {
+        finish_mark();
+    }
+    double since = now();
+    size_t budget = SIZE_MAX;
+    sweep(&budget);
+#ifdef PARALLEL_GC
+    join_background_sweep();
 #endif
+    vm.gc_record.sweep_seconds += lap(&since);
+    finish_cycle();
+}
+
+void reset_GC_stats()
+{
+    memset(&vm.gc_stats, 0, sizeof(GC_stats));
+    vm.gc_finished = false;
+    vm.gc_epoch = now();
+}
+
+static const char* const type_names[obj_type_count] = {
+    [obj_class] = "class",
+    [obj_bound_method] = "bound_method",
+    [obj_function] = "function",
+    [obj_instance] = "instance",
+    [obj_native] = "native",
+    [obj_closure] = "closure",
+    [obj_upvalue] = "upvalue",
+    [obj_shape] = "shape",
+    [obj_string] = "string"
+};
+
+static void log_record(FILE* log, const GC_record* record)
+{
+    fprintf(log, "{\"kind\":\"%s\",\"start\":%.6f,\"mark\":%.6f,\"sweep\":%.6f,"
+        "\"longest_pause\":%.6f,\"pauses\":%d,"
+        "\"bytes_before\":%zu,\"bytes_allocated\":%zu,\"bytes_after\":%zu",
+        record->full ? "full" : "minor", record->start, record->mark_seconds,
+        record->sweep_seconds, record->longest_pause, record->pauses, record->bytes_before,
+        record->bytes_allocated, record->bytes_after);
+    if (vm.gc_settings.census)
+    {
+        fprintf(log, ",\"live\":{");
+        for (int i = 0; i < obj_type_count; i++)
+        {
+            fprintf(log, "%s\"%s\":%zu", i > 0 ? "," : "", type_names[i], record->live[i]);
+        }
+        fprintf(log, "}");
+    }
+    fprintf(log, "}\n");
+}
+
+static void report(const GC_record* record)
+{
+    GC_stats* stats = &vm.gc_stats;
+    if (record->full)
+    {
+        stats->full_cycles++;
+    }
+    else
+    {
+        stats->minor_cycles++;
+    }
+    stats->pause_seconds += record->mark_seconds + record->sweep_seconds;
+    if (record->longest_pause > stats->longest_pause)
+    {
+        stats->longest_pause = record->longest_pause;
+    }
+    stats->bytes_reclaimed += record->bytes_before + record->bytes_allocated - record->bytes_after;
+    stats->last = *record;
+    if (vm.gc_settings.log != NULL)
+    {
+        log_record(vm.gc_settings.log, record);
+    }
 }
+
+// Runs a piece of collector work while the program waits, and reports the
+// collection if that finished it.
+static void pause_for(void (*work)())
+{
+    double since = now();
+    work();
+    double seconds = lap(&since);
+    vm.gc_record.pauses++;
+    if (seconds > vm.gc_record.longest_pause)
+    {
+        vm.gc_record.longest_pause = seconds;
+    }
+    if (vm.gc_finished)
+    {
+        vm.gc_finished = false;
+        report(&vm.gc_record);
+    }
+}
+
+static void open_cycle()
+{
+    if (vm.gc_budget == 0)
+    {
+        mark_atomically();
+    }
+    else
+    {
+        start_cycle();
+    }
+}
+
+// Runs whatever collection work the heap has grown into.
+static void collect_if_needed()
+{
+    if (vm.gc_phase != gc_idle)
+    {
+        if (vm.bytes_allocated > vm.gc_goal + (vm.gc_goal - vm.next_GC))
+        {
+            // The mutator outran the cycle; finish it in one go and give
+            // the next one more room.
+            vm.gc_runway *= 2;
+            pause_for(collect_garbage);
+        }
+        else if (vm.bytes_allocated > vm.next_GC_step)
+        {
+            pause_for(gc_step);
+        }
+    }
+    else if (vm.bytes_allocated > vm.next_GC)
+    {
+        pause_for(open_cycle);
+    }
+    else if (vm.bytes_allocated > vm.next_minor_GC)
+    {
+        pause_for(collect_young);
+    }
+}
+
+#ifdef DEBUG_STRESS_GC
+// Steps a running cycle on every allocation; otherwise alternates minor
+// collections with the start of a new cycle.
+static void stress_garbage_collector()
+{
+    static int count = 0;
+    if (vm.gc_phase != gc_idle)
+    {
+        pause_for(gc_step);
+    }
+    else if (++count % gc_stress_major_interval != 0)
+    {
+        pause_for(collect_young);
+    }
+    else
+    {
+        pause_for(open_cycle);
+    }
+}
+#endif
@@ -1,12 +1,15 @@
 #ifndef clox_memory
 #define clox_memory
 
+#include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 
+#include "chunk.h"
 #include "object.h"
 #include "table.h"
 #include "value.h"
+#include "vm.h"
 
 static inline int grow_capacity(int capacity)
 {
@@ -14,23 +17,62 @@ static inline int grow_capacity(int capacity)
 }
 
 char* allocate_char(int count);
+char* allocate_char_deferred(int count);
 Entry* allocate_entry(int count);
 Upvalue** allocate_upvalues(int count);
 void* allocate_void(size_t size);
+void* allocate_void_deferred(size_t size);
+void* allocate_cell(size_t size);
 
+void free_array_cache(Inline_cache* pointer, int count);
 void free_array_char(char* pointer, int count);
 void free_array_entry(Entry* pointer, int count);
 void free_array_int(int* pointer, int count);
 void free_array_uint8_t(uint8_t* pointer, int count);
 void free_array_upvalues(Upvalue** pointer, int count);
 void free_array_value(Value* pointer, int count);
+void free_cell(void* pointer, size_t size);
 void free_objects();
+bool is_white(Object* object);
 void mark_object(Object* object);
+void mark_new_object(Object* object);
 void mark_value(Value value);
+void remember(Object* object);
+void write_barrier_table(Object* owner, Table* table);
 void collect_garbage();
+void reset_GC_stats();
 
+Inline_cache* grow_array_cache(Inline_cache* pointer, int old, int new);
 int* grow_array_int(int* pointer, int old, int new);
 uint8_t* grow_array_uint8_t(uint8_t* pointer, int old, int new);
 Value* grow_array_value(Value* pointer, int old, int new);
 
+// Every store of an object reference into another object goes through a
+// barrier. An old object that gains a young referent is remembered, so minor
+// collections can find the young object without tracing the old heap. While
+// a cycle is marking, an unmarked object stored into a marked one is grayed
+// so it can't be missed.
+static inline void write_barrier_object(Object* owner, Object* object)
+{
+    if (object != NULL)
+    {
+        if (is_old(owner) && !is_old(object) && !is_remembered(owner))
+        {
+            remember(owner);
+        }
+        if (vm.gc_phase == gc_mark && is_marked(owner) && !is_marked(object))
+        {
+            mark_object(object);
+        }
+    }
+}
+
+static inline void write_barrier(Object* owner, Value value)
+{
+    if (is_object(value))
+    {
+        write_barrier_object(owner, as_object(value));
+    }
+}
+
 #endif
@@ -2,6 +2,7 @@
 #include <stdio.h>
 #include <string.h>
 
+#include "heap.h"
 #include "memory.h"
 #include "object.h"
 #include "table.h"
@@ -10,27 +11,87 @@
 
 static Object* allocate_object(size_t size, Object_type type)
 {
-    Object* object = (Object*)allocate_void(size);
-    object->type = type;
-    object->is_marked = false;
-    object->next = vm.objects;
-    vm.objects = object;
+    Object* object = (Object*)allocate_cell(size);
+    object->header = make_header(type, vm.young_objects);
+    vm.young_objects = object;
+    mark_new_object(object);
 #ifdef DEBUG_LOG_GC
     printf("%p allocate %zu for %d\n", (void*)object, size, type);
 #endif
     return object;
 }
 
-static String* allocate_string(char* chars, int length, uint32_t hash)
+// Concatenations shorter than this are copied right away, as a rope and the
+// copy it takes later would cost more.
+enum String_parameter
 {
-    String* string = (String*)allocate_object(sizeof(String), obj_string);
+    rope_min_length = 64
+};
+
+// Strings up to this long keep their characters in their own cell.
+static const int string_inline_max = heap_max_cell - (int)offsetof(String, bytes) - 1;
+
+static String* new_string(size_t size, int length)
+{
+    String* string = (String*)allocate_object(size, obj_string);
     string->length = length;
-    string->chars = chars;
+    string->hash = 0;
+    string->chars = NULL;
+    string->hashed = false;
+    string->interned = false;
+    string->rope = false;
+    return string;
+}
+
+// Makes a flat string for the caller to write length characters into.
+// A buffer of its own, if it needs one, is allocated first, so the string
+// can't be collected before anything refers to it.
+static String* new_flat_string(int length)
+{
+    String* string;
+    if (length <= string_inline_max)
+    {
+        string = new_string(offsetof(String, bytes) + (size_t)length + 1, length);
+        string->chars = string->bytes;
+    }
+    else
+    {
+        char* chars = allocate_char(length + 1);
+        string = new_string(offsetof(String, bytes), length);
+        string->chars = chars;
+    }
+    string->chars[length] = '\0';
+    return string;
+}
+
+static String* new_rope(String* left, String* right)
+{
+    String* rope = new_string(offsetof(String, bytes) + 2 * sizeof(String*),
+        left->length + right->length);
+    rope->rope = true;
+    memcpy(rope->bytes, &left, sizeof(left));
+    memcpy(rope->bytes + sizeof(left), &right, sizeof(right));
+    return rope;
+}
+
+static void intern_string(String* string, uint32_t hash)
+{
     string->hash = hash;
+    string->hashed = true;
+    string->interned = true;
     push(object_value((Object*)string));
     table_set(&vm.strings, string, nil_value());
     pop();
-    return string;
+}
+
+static Shape* new_shape(Shape* parent, String* name)
+{
+    Shape* shape = (Shape*)allocate_object(sizeof(Shape), obj_shape);
+    shape->parent = parent;
+    shape->name = name;
+    shape->field_count = parent == NULL ? 0 : parent->field_count + 1;
+    init_table(&shape->transitions);
+    return shape;
 }
 
 Class* new_class(String* name)
@@ -38,6 +99,12 @@ Class* new_class(String* name)
     Class* class = (Class*)allocate_object(sizeof(Class), obj_class);
     class->name = name;
     init_table(&class->methods);
+    class->shape = NULL;
+    class->field_hint = 0;
+    push(object_value((Object*)class));
+    class->shape = new_shape(NULL, NULL);
+    write_barrier_object((Object*)class, (Object*)class->shape);
+    pop();
     return class;
 }
 
@@ -60,13 +127,13 @@ Upvalue* new_upvalue(Value* slot)
 
 Closure* new_closure(Function* function)
 {
-    Closure* closure = (Closure*)allocate_object(sizeof(Closure), obj_closure);
-    closure->function = function;
     Upvalue** upvalues = allocate_upvalues(function->upvalue_count);
     for (int i = 0; i < function->upvalue_count; i++)
     {
         upvalues[i] = NULL;
     }
+    Closure* closure = (Closure*)allocate_object(sizeof(Closure), obj_closure);
+    closure->function = function;
     closure->upvalues = upvalues;
     closure->upvalue_count = function->upvalue_count;
     return closure;
@@ -78,15 +145,22 @@ Function* new_function()
     function->arity = 0;
     function->upvalue_count = 0;
     function->name = NULL;
+    function->hotness = 0;
+    function->jit = NULL;
     init_chunk(&function->chunk);
     return function;
 }
 
 Instance* new_instance(Class* class)
 {
+    int capacity = class->field_hint;
+    Value* fields = grow_array_value(NULL, 0, capacity);
     Instance* instance = (Instance*)allocate_object(sizeof(Instance), obj_instance);
     instance->class = class;
-    init_table(&instance->fields);
+    instance->shape = class->shape;
+    instance->fields = fields;
+    instance->capacity = capacity;
+    init_table(&instance->dictionary);
     return instance;
 }
 
@@ -97,34 +171,173 @@ Native* new_native(Value (*function)(int, Value*))
     return native;
 }
 
-static uint32_t hash_string(const char* key, int length)
+int shape_find_slot(Shape* shape, String* name)
 {
-    uint32_t hash = 2166136261u;
-    for (int i = 0; i < length; i++)
+    int slot = -1;
+    while (slot == -1 && shape->parent != NULL)
     {
-        hash ^= (uint8_t)key[i];
-        hash *= 16777619;
+        if (shape->name == name)
+        {
+            slot = shape->field_count - 1;
+        }
+        shape = shape->parent;
     }
-    return hash;
+    return slot;
 }
 
-String* take_string(char* chars, int length)
+static Shape* shape_transition(Shape* shape, String* name)
 {
-    uint32_t hash = hash_string(chars, length);
-    String* string;
-    String* interned = table_find_string(&vm.strings, chars, length, hash);
-    if (interned == NULL)
+    Value next;
+    Shape* result;
+    if (table_get(&shape->transitions, name, &next))
     {
-        string = allocate_string(chars, length, hash);
+        result = (Shape*)as_object(next);
     }
     else
     {
-        free_array_char(chars, length);
-        string = interned;
+        result = new_shape(shape, name);
+        push(object_value((Object*)result));
+        table_set(&shape->transitions, name, object_value((Object*)result));
+        write_barrier_object((Object*)shape, (Object*)result);
+        pop();
     }
-    return string;
+    return result;
 }
 
+static void make_dictionary(Instance* instance)
+{
+    for (Shape* shape = instance->shape; shape->parent != NULL; shape = shape->parent)
+    {
+        table_set(&instance->dictionary, shape->name, instance->fields[shape->field_count - 1]);
+        write_barrier_object((Object*)instance, (Object*)shape->name);
+    }
+    free_array_value(instance->fields, instance->capacity);
+    instance->shape = NULL;
+    instance->fields = NULL;
+    instance->capacity = 0;
+}
+
+// The fields an instance has once its initializer returns are what the
+// next instances of its class start with. Fields added later, and those of
+// instances that went to dictionary mode, don't count, so one wide instance
+// doesn't make every other one large.
+void note_initialized(Instance* instance)
+{
+    if (instance->shape != NULL)
+    {
+        instance->class->field_hint = instance->shape->field_count;
+    }
+}
+
+void instance_set_shape(Instance* instance, Shape* shape)
+{
+    if (instance->capacity < shape->field_count)
+    {
+        int capacity = instance->class->field_hint;
+        if (capacity < shape->field_count)
+        {
+            capacity = grow_capacity(instance->capacity);
+        }
+        instance->fields = grow_array_value(instance->fields, instance->capacity, capacity);
+        instance->capacity = capacity;
+    }
+    instance->shape = shape;
+    write_barrier_object((Object*)instance, (Object*)shape);
+}
+
+bool instance_get(Instance* instance, String* name, Value* value)
+{
+    bool found = false;
+    if (instance->shape == NULL)
+    {
+        found = table_get(&instance->dictionary, name, value);
+    }
+    else
+    {
+        int slot = shape_find_slot(instance->shape, name);
+        if (slot != -1)
+        {
+            *value = instance->fields[slot];
+            found = true;
+        }
+    }
+    return found;
+}
+
+void instance_set(Instance* instance, String* name, Value value)
+{
+    int slot = -1;
+    if (instance->shape != NULL)
+    {
+        slot = shape_find_slot(instance->shape, name);
+        if (slot == -1 && instance->shape->field_count == shape_fields_max)
+        {
+            make_dictionary(instance);
+        }
+    }
+    if (slot != -1)
+    {
+        instance->fields[slot] = value;
+    }
+    else if (instance->shape == NULL)
+    {
+        table_set(&instance->dictionary, name, value);
+        write_barrier_object((Object*)instance, (Object*)name);
+    }
+    else
+    {
+        instance_set_shape(instance, shape_transition(instance->shape, name));
+        instance->fields[instance->shape->field_count - 1] = value;
+    }
+    write_barrier((Object*)instance, value);
+}
+
+// Multiplies into 128 bits and folds the halves together, which spreads
+// every input bit over the whole result.
+static uint64_t mix(uint64_t a, uint64_t b)
+{
+#ifdef __SIZEOF_INT128__
+    unsigned __int128 product = (unsigned __int128)a * b;
+    return (uint64_t)product ^ (uint64_t)(product >> 64);
+#else
+    uint64_t low = (a & 0xffffffff) * (b & 0xffffffff);
+    uint64_t cross_a = (a >> 32) * (b & 0xffffffff);
+    uint64_t cross_b = (a & 0xffffffff) * (b >> 32);
+    uint64_t middle = (low >> 32) + (cross_a & 0xffffffff) + cross_b;
+    uint64_t high = (a >> 32) * (b >> 32) + (cross_a >> 32) + (middle >> 32);
+    return ((middle << 32) | (low & 0xffffffff)) ^ high;
+#endif
+}
+
+static uint64_t read_word(const char* chars)
+{
+    uint64_t word;
+    memcpy(&word, chars, sizeof(word));
+    return word;
+}
+
+// Hashes 16 bytes per step in the manner of wyhash, the last step over
+// the zero-padded tail. Both words of a step are mixed with secret state,
+// so no input can cancel out what came before. Tables mask the low bits,
+// which the final mix makes as good as the high ones.
+static uint32_t hash_string(const char* key, int length)
+{
+    const uint64_t secret[3] = {0xa0761d6478bd642full, 0xe7037ed1a0b428dbull, 0x8ebc6af09c88c6e3ull};
+    uint64_t seed = vm.hash_seed ^ secret[0];
+    uint64_t hash = seed;
+    int i = 0;
+    for (; i + 16 <= length; i += 16)
+    {
+        hash = mix(read_word(key + i) ^ hash, read_word(key + i + 8) ^ seed);
+    }
+    char tail[16] = {0};
+    memcpy(tail, key + i, (size_t)(length - i));
+    hash = mix(read_word(tail) ^ hash, read_word(tail + 8) ^ seed);
+    return (uint32_t)mix(hash ^ secret[1], (uint64_t)length ^ secret[2]);
+}
+
+// Makes the interned string with these characters, for the names and
+// literals the compiler emits.
 String* copy_string(const char* chars, int length)
 {
     uint32_t hash = hash_string(chars, length);
@@ -132,10 +345,9 @@ String* copy_string(const char* chars, int length)
     String* interned = table_find_string(&vm.strings, chars, length, hash);
     if (interned == NULL)
     {
-        char* heap = allocate_char(length + 1);
-        memcpy(heap, chars, length);
-        heap[length] = '\0';
-        string = allocate_string(heap, length, hash);
+        string = new_flat_string(length);
+        memcpy(string->chars, chars, length);
+        intern_string(string, hash);
     }
     else
     {
@@ -144,6 +356,94 @@ String* copy_string(const char* chars, int length)
     return string;
 }
 
+// Runs with both operands on the stack, so the allocations can't free them.
+// Short results are built in place and, like the rest of the strings made
+// at run time, are neither hashed nor interned until a comparison needs
+// their hash. The caller checks that the total length fits in an int.
+String* concatenate_strings(String* a, String* b)
+{
+    String* result;
+    int length = a->length + b->length;
+    if (a->length == 0 || b->length == 0)
+    {
+        result = a->length == 0 ? b : a;
+    }
+    else if (length < rope_min_length)
+    {
+        result = new_flat_string(length);
+        memcpy(result->chars, string_chars(a), a->length);
+        memcpy(result->chars + a->length, string_chars(b), b->length);
+    }
+    else
+    {
+        result = new_rope(a, b);
+    }
+    return result;
+}
+
+// Of the two halves of a rope the shorter is copied by recursion and the
+// longer by the loop, so the recursion stays logarithmic in the length
+// however the rope leans. Nothing is allocated.
+static void copy_chars(String* string, char* dest)
+{
+    while (string->chars == NULL)
+    {
+        String* left = rope_left(string);
+        String* right = rope_right(string);
+        if (left->length < right->length)
+        {
+            copy_chars(left, dest);
+            dest += left->length;
+            string = right;
+        }
+        else
+        {
+            copy_chars(right, dest + left->length);
+            string = left;
+        }
+    }
+    memcpy(dest, string->chars, string->length);
+}
+
+// Flattens a rope on first use, after which the collector no longer traces
+// its halves. The buffer is allocated without collecting, since callers
+// may hold strings they have already popped.
+char* string_chars(String* string)
+{
+    if (string->chars == NULL)
+    {
+        char* chars = allocate_char_deferred(string->length + 1);
+        copy_chars(string, chars);
+        chars[string->length] = '\0';
+        string->chars = chars;
+    }
+    return string->chars;
+}
+
+static uint32_t string_hash(String* string)
+{
+    if (!string->hashed)
+    {
+        string->hash = hash_string(string_chars(string), string->length);
+        string->hashed = true;
+    }
+    return string->hash;
+}
+
+// Two interned strings are the same string or different ones. Otherwise
+// the lengths and hashes rule out most unequal pairs before the characters
+// are compared.
+bool strings_equal(String* a, String* b)
+{
+    bool result = a == b;
+    if (!result && !(a->interned && b->interned) && a->length == b->length
+        && string_hash(a) == string_hash(b))
+    {
+        result = memcmp(a->chars, b->chars, a->length) == 0;
+    }
+    return result;
+}
+
 static void print_function(Function* function)
 {
     if (function->name == NULL)
@@ -169,6 +469,9 @@ void print_object(Value value)
     case obj_upvalue:
         printf("upvalue");
         break;
+    case obj_shape:
+        printf("shape");
+        break;
     case obj_closure:
         print_function(as_closure(value)->function);
         break;
@@ -2,7 +2,9 @@
 #define clox_object
 
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
+#include <string.h>
 
 #include "chunk.h"
 #include "table.h"
@@ -17,34 +19,137 @@ typedef enum
     obj_native,
     obj_closure,
     obj_upvalue,
-    obj_string
+    obj_shape,
+    obj_string,
+    obj_type_count
 } Object_type;
 
+// An object's header is a single word: a link in the low 48 bits, where
+// every user-space address fits, then the type and the old-generation bit.
+// Mark and remembered bits live in the heap page's bitmaps. The old
+// generation has no list, so the link only chains the young objects and,
+// once dead, the objects the background sweeper leaves to the interpreter
+// to free. Several threads may touch a header at once: parallel markers set
+// the old bit while other threads read the type, and the sweeper writes the
+// headers of dead objects. The word is therefore accessed with relaxed
+// atomics, which cost nothing over plain loads and stores.
 typedef struct Object
 {
-    Object_type type;
-    bool is_marked;
-    Object* next;
+    uint64_t header;
 } Object;
 
+enum Object_header
+{
+    header_link_bits = 48,
+    header_type_shift = 48,
+    header_old_shift = 56
+};
+
+static const uint64_t header_link_mask = ((uint64_t)1 << header_link_bits) - 1;
+static const uint64_t header_old_bit = (uint64_t)1 << header_old_shift;
+
+static inline uint64_t load_header(const Object* object)
+{
+    return __atomic_load_n(&object->header, __ATOMIC_RELAXED);
+}
+
+static inline void store_header(Object* object, uint64_t header)
+{
+    __atomic_store_n(&object->header, header, __ATOMIC_RELAXED);
+}
+
+static inline uint64_t make_header(Object_type type, Object* next)
+{
+    return ((uint64_t)type << header_type_shift) | ((uint64_t)(uintptr_t)next & header_link_mask);
+}
+
+static inline Object_type type_of(const Object* object)
+{
+    return (Object_type)((load_header(object) >> header_type_shift) & 0xff);
+}
+
+static inline Object* next_object(const Object* object)
+{
+    return (Object*)(uintptr_t)(load_header(object) & header_link_mask);
+}
+
+static inline void set_next_object(Object* object, Object* next)
+{
+    store_header(object, (load_header(object) & ~header_link_mask)
+        | ((uint64_t)(uintptr_t)next & header_link_mask));
+}
+
+static inline bool is_old(const Object* object)
+{
+    return (load_header(object) & header_old_bit) != 0;
+}
+
+static inline void set_old(Object* object)
+{
+    store_header(object, load_header(object) | header_old_bit);
+}
+
 static inline bool is_object_type(Value value, Object_type type)
 {
-    return is_object(value) && as_object(value)->type == type;
+    return is_object(value) && type_of(as_object(value)) == type;
 }
 
 static inline Object_type object_type(Value value)
 {
-    return as_object(value)->type;
+    return type_of(as_object(value));
 }
 
+// A string is flat, with its characters in chars, or a rope made by
+// concatenation, whose characters are those of its left then right half
+// and whose chars stay NULL until something reads them. A flat string
+// keeps its characters in bytes, in the same cell, when they fit, and
+// chars points there; a rope keeps its halves there instead. Strings the
+// compiler makes, which name variables, properties and methods, are
+// interned: only one of each exists and it is hashed up front. Those built
+// at run time are not, so they compare by content and hash on demand.
 typedef struct String
 {
     Object object;
     int length;
-    char* chars;
     uint32_t hash;
+    char* chars;
+    bool hashed;
+    bool interned;
+    bool rope;
+    char bytes[];
 } String;
 
+static inline String* rope_left(const String* rope)
+{
+    String* left;
+    memcpy(&left, rope->bytes, sizeof(left));
+    return left;
+}
+
+static inline String* rope_right(const String* rope)
+{
+    String* right;
+    memcpy(&right, rope->bytes + sizeof(right), sizeof(right));
+    return right;
+}
+
+// The size of the string's cell, which allocating and freeing must agree on.
+static inline size_t string_size(const String* string)
+{
+    size_t size = offsetof(String, bytes);
+    if (string->rope)
+    {
+        size += 2 * sizeof(String*);
+    }
+    else if (string->chars == string->bytes)
+    {
+        size += (size_t)string->length + 1;
+    }
+    return size;
+}
+
+char* string_chars(String* string);
+
 static inline bool is_string(Value value)
 {
     return is_object_type(value, obj_string);
@@ -57,16 +162,20 @@ static inline String* as_string(Value value)
 
 static inline char* as_cstring(Value value)
 {
-    return as_string(value)->chars;
+    return string_chars(as_string(value));
 }
 
-typedef struct
+typedef struct Jit_code Jit_code;
+
+typedef struct Function
 {
     Object object;
     int arity;
     int upvalue_count;
     Chunk chunk;
     String* name;
+    int hotness;
+    Jit_code* jit;
 } Function;
 
 static inline bool is_function(Value value)
@@ -103,7 +212,7 @@ typedef struct Upvalue
     struct Upvalue* next;
 } Upvalue;
 
-typedef struct
+typedef struct Closure
 {
     Object object;
     Function* function;
@@ -121,11 +230,31 @@ static inline Closure* as_closure(Value value)
     return (Closure*)as_object(value);
 }
 
-typedef struct
+enum Shape_parameter
+{
+    shape_fields_max = 64
+};
+
+// A shape describes the field layout of an instance: the field it adds to
+// its parent and the slot that field lives in. Instances built by setting
+// the same fields in the same order share a shape, found by following the
+// transitions from the root shape of their class.
+typedef struct Shape
+{
+    Object object;
+    struct Shape* parent;
+    String* name;
+    int field_count;
+    Table transitions;
+} Shape;
+
+typedef struct Class
 {
     Object object;
     String* name;
     Table methods;
+    Shape* shape;
+    int field_hint;
 } Class;
 
 static inline bool is_class(Value value)
@@ -138,11 +267,17 @@ static inline Class* as_class(Value value)
     return (Class*)as_object(value);
 }
 
+// Fields are stored by slot in a Value array described by the shape. An
+// instance that outgrows shape_fields_max drops its shape and keeps its
+// fields in a hash table instead.
 typedef struct
 {
     Object object;
     Class* class;
-    Table fields;
+    Shape* shape;
+    Value* fields;
+    int capacity;
+    Table dictionary;
 } Instance;
 
 static inline bool is_instance(Value value)
@@ -179,8 +314,14 @@ Closure* new_closure(Function* function);
 Function* new_function();
 Instance* new_instance(Class* class);
 Native* new_native(Value(*function)(int, Value*));
-String* take_string(char* chars, int length);
+int shape_find_slot(Shape* shape, String* name);
+void note_initialized(Instance* instance);
+void instance_set_shape(Instance* instance, Shape* shape);
+bool instance_get(Instance* instance, String* name, Value* value);
+void instance_set(Instance* instance, String* name, Value value);
 String* copy_string(const char* chars, int length);
+String* concatenate_strings(String* a, String* b);
+bool strings_equal(String* a, String* b);
 void print_object(Value value);
 
 #endif
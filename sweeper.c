@@ -0,0 +1,160 @@
+// pthreads are POSIX, not part of strict C11 builds.
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdlib.h>
+
+#include "heap.h"
+#include "object.h"
+#include "sweeper.h"
+
+#ifdef PARALLEL_GC
+
+#include <pthread.h>
+#include <stdatomic.h>
+
+typedef struct
+{
+    pthread_t thread;
+    bool started;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    bool quit;
+    Page* pages;
+    void (*free_object)(Object*);
+    Object* deferred;
+    Cell_list cells;
+    atomic_size_t freed;
+    atomic_bool done;
+} Sweeper;
+
+static Sweeper sweeper = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .wake = PTHREAD_COND_INITIALIZER,
+    .done = true
+};
+
+static _Thread_local bool is_sweeper = false;
+
+static bool must_defer(Object* object)
+{
+    return type_of(object) == obj_function
+        || (type_of(object) == obj_string && ((String*)object)->interned);
+}
+
+static void sweep_dead(void* cell)
+{
+    Object* object = (Object*)cell;
+    if (must_defer(object))
+    {
+        set_next_object(object, sweeper.deferred);
+        sweeper.deferred = object;
+    }
+    else
+    {
+        sweeper.free_object(object);
+    }
+}
+
+static void* run_sweeper(void* argument)
+{
+    (void)argument;
+    is_sweeper = true;
+    pthread_mutex_lock(&sweeper.lock);
+    for (;;)
+    {
+        while (sweeper.pages == NULL && !sweeper.quit)
+        {
+            pthread_cond_wait(&sweeper.wake, &sweeper.lock);
+        }
+        if (sweeper.quit)
+        {
+            break;
+        }
+        Page* page = sweeper.pages;
+        sweeper.pages = NULL;
+        pthread_mutex_unlock(&sweeper.lock);
+        for (; page != NULL; page = page->next)
+        {
+            heap_sweep_page(page, sweep_dead);
+        }
+        atomic_store(&sweeper.done, true);
+        pthread_mutex_lock(&sweeper.lock);
+        pthread_cond_broadcast(&sweeper.wake);
+    }
+    pthread_mutex_unlock(&sweeper.lock);
+    return NULL;
+}
+
+void sweep_in_background(Page* pages, void (*free_object)(Object*))
+{
+    if (!sweeper.started)
+    {
+        if (pthread_create(&sweeper.thread, NULL, run_sweeper, NULL) != 0)
+        {
+            exit(1);
+        }
+        sweeper.started = true;
+    }
+    pthread_mutex_lock(&sweeper.lock);
+    sweeper.free_object = free_object;
+    sweeper.deferred = NULL;
+    atomic_store(&sweeper.freed, 0);
+    atomic_store(&sweeper.done, pages == NULL);
+    sweeper.pages = pages;
+    pthread_cond_broadcast(&sweeper.wake);
+    pthread_mutex_unlock(&sweeper.lock);
+}
+
+bool on_sweeper_thread()
+{
+    return is_sweeper;
+}
+
+void count_swept(size_t bytes)
+{
+    atomic_fetch_add_explicit(&sweeper.freed, bytes, memory_order_relaxed);
+}
+
+void release_cell(void* pointer)
+{
+    cell_list_add(&sweeper.cells, pointer);
+}
+
+bool background_sweep_done()
+{
+    return atomic_load(&sweeper.done);
+}
+
+// Waits for the sweep to finish, returns the freed cells to the heap and
+// hands back the deferred objects and the number of bytes freed.
+void join_sweeper(Object** deferred, size_t* freed, Heap* heap)
+{
+    pthread_mutex_lock(&sweeper.lock);
+    while (!atomic_load(&sweeper.done))
+    {
+        pthread_cond_wait(&sweeper.wake, &sweeper.lock);
+    }
+    heap_reclaim(heap, &sweeper.cells);
+    *deferred = sweeper.deferred;
+    *freed = atomic_exchange(&sweeper.freed, 0);
+    sweeper.deferred = NULL;
+    pthread_mutex_unlock(&sweeper.lock);
+}
+
+void free_sweeper()
+{
+    if (sweeper.started)
+    {
+        pthread_mutex_lock(&sweeper.lock);
+        sweeper.quit = true;
+        pthread_cond_broadcast(&sweeper.wake);
+        pthread_mutex_unlock(&sweeper.lock);
+        pthread_join(sweeper.thread, NULL);
+        sweeper.started = false;
+        sweeper.quit = false;
+    }
+}
+
+#endif
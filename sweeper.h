@@ -0,0 +1,30 @@
+#ifndef clox_sweeper
+#define clox_sweeper
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "heap.h"
+#include "object.h"
+
+#ifdef PARALLEL_GC
+
+// Sweeping the heap on a thread of its own. The sweeper gets the heap's pages
+// once marking is over and frees what is unmarked while the interpreter
+// keeps running. Functions are handed back dead rather than freed: their
+// native code lives in the JIT arena, which only the interpreter's thread
+// may touch. So are interned strings, which leave the intern table as they
+// are freed. Likewise the cells of freed objects are kept aside and only
+// returned to the heap when the sweep is joined.
+
+void sweep_in_background(Page* pages, void (*free_object)(Object*));
+bool on_sweeper_thread();
+void count_swept(size_t bytes);
+void release_cell(void* pointer);
+bool background_sweep_done();
+void join_sweeper(Object** deferred, size_t* freed, Heap* heap);
+void free_sweeper();
+
+#endif
+
+#endif
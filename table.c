@@ -8,127 +8,245 @@
 #include "table.h"
 #include "value.h"
 
-static const double table_max_load = 0.75;
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
-static Entry* find_entry(Entry* entries, int capacity, String* key)
+// Full slots hold the low seven bits of the key's hash, which always have
+// the high bit clear; the rest of the hash picks the first group to probe.
+enum Control
 {
-    uint32_t index = key->hash & (capacity - 1);
-    Entry* tombstone = NULL;
-    Entry* entry = NULL;
-    bool found = false;
-    while (!found)
+    control_empty = 0x80,
+    control_deleted = 0xfe
+};
+
+// Up to seven slots in eight are used, deleted ones included, before the
+// table is rebuilt.
+static bool over_load(int used, int capacity)
+{
+    return used * 8 > capacity * 7;
+}
+
+static uint8_t fragment_of(uint32_t hash)
+{
+    return hash & 0x7f;
+}
+
+// Bit i of the result is set when slot i of the group holds byte.
+static uint32_t match_byte(const uint8_t* group, uint8_t byte)
+{
+#ifdef __SSE2__
+    __m128i controls = _mm_loadu_si128((const __m128i*)group);
+    return (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(controls, _mm_set1_epi8((char)byte)));
+#else
+    uint32_t mask = 0;
+    for (int i = 0; i < table_group; i++)
+    {
+        mask |= (uint32_t)(group[i] == byte) << i;
+    }
+    return mask;
+#endif
+}
+
+// Empty and deleted slots are the ones with the high bit set.
+static uint32_t match_free(const uint8_t* group)
+{
+#ifdef __SSE2__
+    return (uint32_t)_mm_movemask_epi8(_mm_loadu_si128((const __m128i*)group));
+#else
+    uint32_t mask = 0;
+    for (int i = 0; i < table_group; i++)
+    {
+        mask |= (uint32_t)(group[i] >> 7) << i;
+    }
+    return mask;
+#endif
+}
+
+static int first_group(uint32_t hash, int capacity)
+{
+    return (int)(hash >> 7) & (capacity / table_group - 1);
+}
+
+// Groups are probed at triangular offsets, which visit every group of a
+// power-of-two table.
+static int next_group(int group, int step, int capacity)
+{
+    return (group + step) & (capacity / table_group - 1);
+}
+
+// Returns the slot holding key, or -1.
+static int find_slot(Table* table, String* key)
+{
+    int slot = -1;
+    if (table->count != 0)
     {
-        entry = &entries[index];
-        if (entry->key == NULL)
+        uint8_t fragment = fragment_of(key->hash);
+        int group = first_group(key->hash, table->capacity);
+        bool stop = false;
+        for (int step = 1; !stop; step++)
         {
-            if (is_nil(entry->value))
+            const uint8_t* control = table->control + group * table_group;
+            uint32_t matches = match_byte(control, fragment);
+            while (matches != 0 && slot == -1)
             {
-                found = true;
-                if (tombstone != NULL)
+                int candidate = group * table_group + __builtin_ctz(matches);
+                matches &= matches - 1;
+                if (table->entries[candidate].key == key)
                 {
-                    entry = tombstone;
+                    slot = candidate;
                 }
             }
-            else if (tombstone == NULL)
-            {
-                tombstone = entry;
-            }
-        }
-        else if (entry->key == key)
-        {
-            found = true;
+            stop = slot != -1 || match_byte(control, control_empty) != 0;
+            group = next_group(group, step, table->capacity);
         }
-        index = (index + 1) & (capacity - 1);
     }
-    return entry;
+    return slot;
 }
 
-static void adjust_capacity(Table* table, int capacity)
+// Returns the first empty or deleted slot on the key's probe sequence.
+static int find_free_slot(const uint8_t* control, int capacity, uint32_t hash)
 {
-    Entry* entries = allocate_entry(capacity);
+    int group = first_group(hash, capacity);
+    uint32_t free = match_free(control + group * table_group);
+    for (int step = 1; free == 0; step++)
+    {
+        group = next_group(group, step, capacity);
+        free = match_free(control + group * table_group);
+    }
+    return group * table_group + __builtin_ctz(free);
+}
+
+static void fill_slot(Table* table, int slot, String* key, Value value)
+{
+    if (table->control[slot] == control_empty)
+    {
+        table->used++;
+    }
+    table->control[slot] = fragment_of(key->hash);
+    table->entries[slot].key = key;
+    table->entries[slot].value = value;
+    table->count++;
+}
+
+// Moves the full slots into the given arrays, which replace the table's,
+// leaving the deleted slots behind.
+static void rebuild(Table* table, int capacity, uint8_t* control, Entry* entries)
+{
+    memset(control, control_empty, capacity);
     for (int i = 0; i < capacity; i++)
     {
         entries[i].key = NULL;
         entries[i].value = nil_value();
     }
+    uint8_t* old_control = table->control;
+    Entry* old_entries = table->entries;
+    int old_capacity = table->capacity;
+    table->control = control;
+    table->entries = entries;
+    table->capacity = capacity;
     table->count = 0;
-    for (int i = 0; i < table->capacity; i++)
+    table->used = 0;
+    for (int i = 0; i < old_capacity; i++)
     {
-        Entry* entry = &table->entries[i];
+        Entry* entry = &old_entries[i];
         if (entry->key != NULL)
         {
-            Entry* dest = find_entry(entries, capacity, entry->key);
-            dest->key = entry->key;
-            dest->value = entry->value;
-            table->count++;
+            fill_slot(table, find_free_slot(control, capacity, entry->key->hash), entry->key,
+                entry->value);
         }
     }
-    free_array_entry(table->entries, table->capacity);
-    table->entries = entries;
-    table->capacity = capacity;
+    free_array_uint8_t(old_control, old_capacity);
+    free_array_entry(old_entries, old_capacity);
+}
+
+// Rebuilds the table without its deleted slots, twice as large if it is
+// more than half full of live entries. Both arrays are allocated before the
+// old ones are read, since allocating can collect and change the table.
+static void rehash(Table* table)
+{
+    int capacity = table->capacity == 0 ? table_group : table->capacity;
+    if (over_load((table->count + 1) * 2, capacity))
+    {
+        capacity *= 2;
+    }
+    uint8_t* control = grow_array_uint8_t(NULL, 0, capacity);
+    Entry* entries = allocate_entry(capacity);
+    rebuild(table, capacity, control, entries);
+}
+
+// A probe only moves past a group that had no empty slot, so a slot in a
+// group that still has one can go back to empty.
+static void clear_slot(Table* table, int slot)
+{
+    const uint8_t* group = table->control + slot / table_group * table_group;
+    if (match_byte(group, control_empty) != 0)
+    {
+        table->control[slot] = control_empty;
+        table->used--;
+    }
+    else
+    {
+        table->control[slot] = control_deleted;
+    }
+    table->entries[slot].key = NULL;
+    table->entries[slot].value = nil_value();
+    table->count--;
 }
 
 void init_table(Table* table)
 {
     table->count = 0;
+    table->used = 0;
     table->capacity = 0;
+    table->control = NULL;
     table->entries = NULL;
 }
 
 void free_table(Table* table)
 {
+    free_array_uint8_t(table->control, table->capacity);
     free_array_entry(table->entries, table->capacity);
     init_table(table);
 }
 
 bool table_get(Table* table, String* key, Value* value)
 {
-    bool found = false;
-    if (table->count != 0)
+    int slot = find_slot(table, key);
+    if (slot != -1)
     {
-        Entry* entry = find_entry(table->entries, table->capacity, key);
-        if (entry->key != NULL)
-        {
-            *value = entry->value;
-            found = true;
-        }
+        *value = table->entries[slot].value;
     }
-    return found;
+    return slot != -1;
 }
 
 bool table_set(Table* table, String* key, Value value)
 {
-    if (table->count + 1 > table->capacity * table_max_load)
+    int slot = find_slot(table, key);
+    bool is_new = slot == -1;
+    if (is_new)
     {
-        int capacity = grow_capacity(table->capacity);
-        adjust_capacity(table, capacity);
+        if (table->capacity == 0 || over_load(table->used + 1, table->capacity))
+        {
+            rehash(table);
+        }
+        fill_slot(table, find_free_slot(table->control, table->capacity, key->hash), key, value);
     }
-    Entry* entry = find_entry(table->entries, table->capacity, key);
-    bool is_new = entry->key == NULL;
-    if (is_new && is_nil(entry->value))
+    else
     {
-        table->count++;
+        table->entries[slot].value = value;
     }
-    entry->key = key;
-    entry->value = value;
     return is_new;
 }
 
 bool table_delete(Table* table, String* key)
 {
-    bool deleted = false;
-    if (table->count != 0)
+    int slot = find_slot(table, key);
+    if (slot != -1)
     {
-        Entry* entry = find_entry(table->entries, table->capacity, key);
-        if (entry->key != NULL)
-        {
-            // Place a tombstone in the entry.
-            entry->key = NULL;
-            entry->value = bool_value(true);
-            deleted = true;
-        }
+        clear_slot(table, slot);
     }
-    return deleted;
+    return slot != -1;
 }
 
 void table_add_all(Table* from, Table* to)
@@ -143,30 +261,38 @@ void table_add_all(Table* from, Table* to)
     }
 }
 
+// The intern table is weak: its strings leave it as they are freed. Those
+// a cycle found unreachable linger until the sweep gets to them and must
+// not be handed out again meanwhile, or they would be freed while in use.
+static bool is_dead(String* key)
+{
+    return vm.gc_phase == gc_sweep && !is_marked(key);
+}
+
 String* table_find_string(Table* table, const char* chars, int length, uint32_t hash)
 {
     String* string = NULL;
     if (table->count != 0)
     {
-        uint32_t index = hash & (table->capacity - 1);
+        uint8_t fragment = fragment_of(hash);
+        int group = first_group(hash, table->capacity);
         bool stop = false;
-        while (!stop)
+        for (int step = 1; !stop; step++)
         {
-            Entry* entry = &table->entries[index];
-            if (entry->key == NULL)
+            const uint8_t* control = table->control + group * table_group;
+            uint32_t matches = match_byte(control, fragment);
+            while (matches != 0 && string == NULL)
             {
-                if (is_nil(entry->value))
+                String* key = table->entries[group * table_group + __builtin_ctz(matches)].key;
+                matches &= matches - 1;
+                if (!is_dead(key) && key->length == length && key->hash == hash
+                    && memcmp(key->chars, chars, length) == 0)
                 {
-                    stop = true;
+                    string = key;
                 }
             }
-            else if (entry->key->length == length && entry->key->hash == hash
-                && memcmp(entry->key->chars, chars, length) == 0)
-            {
-                string = entry->key;
-                stop = true;
-            }
-            index = (index + 1) & (table->capacity - 1);
+            stop = string != NULL || match_byte(control, control_empty) != 0;
+            group = next_group(group, step, table->capacity);
         }
     }
     return string;
@@ -182,14 +308,24 @@ void mark_table(Table* table)
     }
 }
 
-void table_remove_white(Table* table)
+// Shrinks a table that has lost most of its entries, or that deletions
+// have filled with deleted slots, to the size rehash() would have grown it
+// to. It can run at the end of a collection, so it must not collect.
+void table_compact(Table* table)
 {
-    for (int i = 0; i < table->capacity; i++)
+    int capacity = table_group;
+    while (over_load(table->count * 2, capacity))
     {
-        Entry* entry = &table->entries[i];
-        if (entry->key != NULL && !entry->key->object.is_marked)
-        {
-            table_delete(table, entry->key);
-        }
+        capacity *= 2;
+    }
+    if (table->count == 0)
+    {
+        free_table(table);
+    }
+    else if (capacity <= table->capacity / 4 || (table->used - table->count) * 8 > table->capacity)
+    {
+        uint8_t* control = (uint8_t*)allocate_void_deferred(sizeof(uint8_t) * capacity);
+        Entry* entries = (Entry*)allocate_void_deferred(sizeof(Entry) * capacity);
+        rebuild(table, capacity, control, entries);
     }
 }
@@ -15,10 +15,23 @@ typedef struct
     Value value;
 } Entry;
 
+enum Table_parameter
+{
+    table_group = 16
+};
+
+// Besides its entries a table keeps a control byte per slot: empty,
+// deleted, or for a full slot the low seven bits of its key's hash. A
+// lookup compares those bits for a whole group of slots at once and only
+// looks at the keys that match, stopping at the first group with an empty
+// slot. Slots that aren't full have a NULL key and a nil value. used counts
+// the full and deleted slots, which is what lengthens probes.
 typedef struct
 {
     int count;
+    int used;
     int capacity;
+    uint8_t* control;
     Entry* entries;
 } Table;
 
@@ -30,6 +43,6 @@ bool table_delete(Table* table, String* key);
 void table_add_all(Table* from, Table* to);
 String* table_find_string(Table* table, const char* chars, int length, uint32_t hash);
 void mark_table(Table* table);
-void table_remove_white(Table* table);
+void table_compact(Table* table);
 
 #endif
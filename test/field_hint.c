@@ -0,0 +1,66 @@
+// Checks that the fields of a small instance are sized for what its class's
+// initializer sets up, after an instance of the same class has grown wide
+// and gone to dictionary mode.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../object.h"
+#include "../vm.h"
+
+static const char* const source =
+    "class Point\n"
+    "{\n"
+    "    init(x, y)\n"
+    "    {\n"
+    "        this.x = x;\n"
+    "        this.y = y;\n"
+    "    }\n"
+    "}\n"
+    "var wide = Point(0, 0);\n"
+    "fun widen(p)\n"
+    "{\n"
+    "    p.a0 = 0; p.a1 = 0; p.a2 = 0; p.a3 = 0; p.a4 = 0; p.a5 = 0; p.a6 = 0; p.a7 = 0;\n"
+    "    p.b0 = 0; p.b1 = 0; p.b2 = 0; p.b3 = 0; p.b4 = 0; p.b5 = 0; p.b6 = 0; p.b7 = 0;\n"
+    "    p.c0 = 0; p.c1 = 0; p.c2 = 0; p.c3 = 0; p.c4 = 0; p.c5 = 0; p.c6 = 0; p.c7 = 0;\n"
+    "    p.d0 = 0; p.d1 = 0; p.d2 = 0; p.d3 = 0; p.d4 = 0; p.d5 = 0; p.d6 = 0; p.d7 = 0;\n"
+    "    p.e0 = 0; p.e1 = 0; p.e2 = 0; p.e3 = 0; p.e4 = 0; p.e5 = 0; p.e6 = 0; p.e7 = 0;\n"
+    "    p.f0 = 0; p.f1 = 0; p.f2 = 0; p.f3 = 0; p.f4 = 0; p.f5 = 0; p.f6 = 0; p.f7 = 0;\n"
+    "    p.g0 = 0; p.g1 = 0; p.g2 = 0; p.g3 = 0; p.g4 = 0; p.g5 = 0; p.g6 = 0; p.g7 = 0;\n"
+    "    p.h0 = 0; p.h1 = 0; p.h2 = 0; p.h3 = 0; p.h4 = 0; p.h5 = 0; p.h6 = 0;\n"
+    "}\n"
+    "var almost = Point(1, 2);\n"
+    "widen(almost);\n"
+    "widen(wide);\n"
+    "wide.h7 = 0;\n"
+    "var small = Point(3, 4);\n";
+
+static Instance* global_instance(const char* name)
+{
+    String* string = copy_string(name, (int)strlen(name));
+    return as_instance(vm.globals.values[resolve_global(string)]);
+}
+
+int main()
+{
+    init_VM();
+    int result = 0;
+    if (interpret(source) != interpret_ok)
+    {
+        result = 1;
+    }
+    else
+    {
+        Instance* small = global_instance("small");
+        printf("small instance: %d fields, capacity %d\n", small->shape->field_count,
+            small->capacity);
+        if (small->capacity > 8)
+        {
+            printf("FAIL: the wide instances sized the small one\n");
+            result = 1;
+        }
+    }
+    free_VM();
+    return result;
+}
@@ -0,0 +1,33 @@
+#!/bin/sh
+# Runs a program whose live heap outgrows --gc-limit and checks that the
+# collector doesn't fall into running full cycles back to back: it must
+# take at most twice as many as with no limit, plus a couple.
+#
+# usage: test/gc_limit.sh [clox binary]
+
+set -e
+cd "$(dirname "$0")"
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+clox=$1
+if [ -z "$clox" ]
+then
+    clox="$work/clox"
+    ${CC:-cc} -std=c11 -O2 ../*.c -o "$clox" -lm -lpthread
+fi
+
+full_cycles()
+{
+    "$clox" "$@" --gc-log="$work/log" gc_limit.lox > /dev/null
+    grep -c '"kind":"full"' "$work/log" || true
+}
+
+free=$(full_cycles)
+limited=$(full_cycles --gc-limit=8)
+echo "full cycles: $free without a limit, $limited with --gc-limit=8"
+if [ "$limited" -gt $((free * 2 + 2)) ]
+then
+    echo "FAIL: too many full cycles under the limit"
+    exit 1
+fi
+echo "ok"
@@ -0,0 +1,21 @@
+#!/bin/sh
+# Builds clox and the C tests, then runs every test.
+#
+# usage: test/run.sh
+
+set -e
+cd "$(dirname "$0")"
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+cc=${CC:-cc}
+sources=$(ls ../*.c | grep -v clox.c)
+
+$cc -std=c11 -O2 ../*.c -o "$work/clox" -lm -lpthread
+./gc_limit.sh "$work/clox"
+./string_length.sh "$work/clox"
+for test in *.c
+do
+    $cc -std=c11 -O2 "$test" $sources -o "$work/${test%.c}" -lm -lpthread
+    "$work/${test%.c}"
+done
+echo "all tests passed"
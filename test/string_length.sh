@@ -0,0 +1,26 @@
+#!/bin/sh
+# Runs a program that concatenates past the longest string an int can
+# measure and checks that it stops with "String too long." and exit code 70
+# rather than crashing.
+#
+# usage: test/string_length.sh [clox binary]
+
+cd "$(dirname "$0")"
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+clox=$1
+if [ -z "$clox" ]
+then
+    clox="$work/clox"
+    ${CC:-cc} -std=c11 -O2 ../*.c -o "$clox" -lm -lpthread || exit 1
+fi
+
+"$clox" string_length.lox > "$work/out" 2> "$work/err"
+status=$?
+if [ "$status" -ne 70 ] || ! grep -q "String too long." "$work/err"
+then
+    echo "FAIL: exit code $status"
+    cat "$work/err"
+    exit 1
+fi
+echo "ok"
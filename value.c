@@ -21,6 +21,10 @@ bool values_equal(Value a, Value b)
     {
         result = as_number(a) == as_number(b);
     }
+    else if (a != b && is_string(a) && is_string(b))
+    {
+        result = strings_equal(as_string(a), as_string(b));
+    }
     else
     {
         result = a == b;
@@ -34,6 +38,7 @@ bool values_equal(Value a, Value b)
             result = as_bool(a) == as_bool(b);
             break;
         case val_nil:
+        case val_undefined:
             result = true;
             break;
         case val_number:
@@ -42,6 +47,10 @@ bool values_equal(Value a, Value b)
         case val_object:
         {
             result = as_object(a) == as_object(b);
+            if (!result && is_string(a) && is_string(b))
+            {
+                result = strings_equal(as_string(a), as_string(b));
+            }
             break;
         }
         default:
@@ -110,6 +119,8 @@ void print_value(Value value)
     case val_object:
         print_object(value);
         break;
+    case val_undefined:
+        break;
     }
 #endif
 }
@@ -14,7 +14,8 @@ enum Value_tag
 {
     tag_nil = 1,
     tag_false = 2,
-    tag_true = 3
+    tag_true = 3,
+    tag_undefined = 4
 };
 
 static inline uint64_t qnan()
@@ -64,6 +65,11 @@ static inline Value nil_value()
     return (Value)(uint64_t)(qnan() | tag_nil);
 }
 
+static inline Value undefined_value()
+{
+    return (Value)(uint64_t)(qnan() | tag_undefined);
+}
+
 static inline Value number_value(double num)
 {
     Value value;
@@ -96,6 +102,11 @@ static inline bool is_object(Value value)
     return (value & (qnan() | sign_bit())) == (qnan() | sign_bit());
 }
 
+static inline bool is_undefined(Value value)
+{
+    return value == undefined_value();
+}
+
 #else
 
 typedef enum
@@ -103,7 +114,8 @@ typedef enum
     val_bool,
     val_nil,
     val_number,
-    val_object
+    val_object,
+    val_undefined
 } Value_type;
 
 typedef struct
@@ -137,6 +149,11 @@ static inline bool is_object(Value value)
     return value.type == val_object;
 }
 
+static inline bool is_undefined(Value value)
+{
+    return value.type == val_undefined;
+}
+
 static inline bool as_bool(Value value)
 {
     return value.as.boolean;
@@ -176,6 +193,12 @@ static inline Value object_value(Object* object)
     return v;
 }
 
+static inline Value undefined_value()
+{
+    Value v = {val_undefined, {.number = 0}};
+    return v;
+}
+
 #endif
 
 typedef struct
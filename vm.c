@@ -1,3 +1,4 @@
+#include <limits.h>
 #include <stdarg.h>
 #include <stdbool.h>
 #include <stdint.h>
@@ -7,8 +8,10 @@
 
 #include "chunk.h"
 #include "compiler.h"
+#include "marker.h"
 #include "memory.h"
 #include "object.h"
+#include "sweeper.h"
 #include "table.h"
 #include "value.h"
 #include "vm.h"
@@ -17,6 +20,10 @@
 #include "debug.h"
 #endif
 
+#if defined(__GNUC__) && !defined(SWITCH_DISPATCH)
+#define THREADED_DISPATCH
+#endif
+
 VM vm;
 
 static Value clock_native(int arg_count, Value* args)
@@ -26,26 +33,29 @@ static Value clock_native(int arg_count, Value* args)
     return number_value((double)clock() / CLOCKS_PER_SEC);
 }
 
-static inline uint8_t read_byte(Call_frame* frame)
-{
-    return *frame->ip++;
-}
-
-static inline Value read_constant(Call_frame* frame)
+// String hashes are seeded per process so that which strings collide in a
+// table can't be worked out ahead of time. The seed comes from
+// /dev/urandom where there is one, else from the clock and the address
+// layout.
+static uint64_t random_seed()
 {
-    uint8_t byte = read_byte(frame);
-    return frame->closure->function->chunk.constants.values[byte];
-}
-
-static inline uint16_t read_short(Call_frame* frame)
-{
-    frame->ip += 2;
-    return (uint16_t)((frame->ip[-2] << 8) | frame->ip[-1]);
-}
-
-static inline String* read_string(Call_frame* frame)
-{
-    return as_string(read_constant(frame));
+    struct timespec time;
+    timespec_get(&time, TIME_UTC);
+    uint64_t seed = (uint64_t)time.tv_sec * 1000000007u ^ (uint64_t)time.tv_nsec
+        ^ (uint64_t)(uintptr_t)&seed;
+#ifdef __unix__
+    FILE* random = fopen("/dev/urandom", "rb");
+    if (random != NULL)
+    {
+        uint64_t bytes;
+        if (fread(&bytes, sizeof(bytes), 1, random) == 1)
+        {
+            seed ^= bytes;
+        }
+        fclose(random);
+    }
+#endif
+    return seed;
 }
 
 static Value peek(int distance)
@@ -82,11 +92,23 @@ static void define_native(const char* name, Value (*function)(int, Value*))
 {
     push(object_value((Object*)copy_string(name, (int)strlen(name))));
     push(object_value((Object*)new_native(function)));
-    table_set(&vm.globals, as_string(vm.stack[0]), vm.stack[1]);
+    int slot = resolve_global(as_string(vm.stack[0]));
+    vm.globals.values[slot] = vm.stack[1];
     pop();
     pop();
 }
 
+#ifdef JIT
+// Counts calls and loop back-edges; a function is compiled once it is hot.
+static void heat(Function* function)
+{
+    if (++function->hotness == jit_hot_threshold)
+    {
+        jit_compile(function);
+    }
+}
+#endif
+
 static bool call(Closure* closure, int arg_count)
 {
     bool result = false;
@@ -104,6 +126,9 @@ static bool call(Closure* closure, int arg_count)
         frame->closure = closure;
         frame->ip = closure->function->chunk.code;
         frame->slots = vm.stack_top - arg_count - 1;
+#ifdef JIT
+        heat(closure->function);
+#endif
         return true;
     }
     return result;
@@ -162,13 +187,74 @@ static bool call_value(Value callee, int arg_count)
     return result;
 }
 
-static bool invoke_from_class(Class* class, String* name, int arg_count)
+static void close_upvalues(Value* last)
+{
+    while (vm.open_upvalues != NULL && vm.open_upvalues->location >= last)
+    {
+        Upvalue* upvalue = vm.open_upvalues;
+        upvalue->closed = *upvalue->location;
+        upvalue->location = &upvalue->closed;
+        write_barrier((Object*)upvalue, upvalue->closed);
+        vm.open_upvalues = upvalue->next;
+    }
+}
+
+// Calls closure in place of the current frame: the callee and its arguments
+// slide down over the caller's slots so the frame can be reused.
+static bool tail_call(Closure* closure, int arg_count)
+{
+    bool result = false;
+    if (arg_count != closure->function->arity)
+    {
+        runtime_error("Expected %d arguments but got %d.", closure->function->arity, arg_count);
+    }
+    else
+    {
+        Call_frame* frame = &vm.frames[vm.frame_count - 1];
+        close_upvalues(frame->slots);
+        memmove(frame->slots, vm.stack_top - arg_count - 1, sizeof(Value) * (arg_count + 1));
+        vm.stack_top = frame->slots + arg_count + 1;
+        frame->closure = closure;
+        frame->ip = closure->function->chunk.code;
+#ifdef JIT
+        heat(closure->function);
+#endif
+        result = true;
+    }
+    return result;
+}
+
+// Classes and natives don't run in a frame of their own, so they are called
+// normally and the return that follows the tail call hands back their result.
+static bool tail_call_value(Value callee, int arg_count)
+{
+    bool result;
+    if (is_closure(callee))
+    {
+        result = tail_call(as_closure(callee), arg_count);
+    }
+    else if (is_bound_method(callee))
+    {
+        Bound_method* bound = as_bound_method(callee);
+        vm.stack_top[-arg_count - 1] = bound->receiver;
+        result = tail_call(bound->method, arg_count);
+    }
+    else
+    {
+        result = call_value(callee, arg_count);
+    }
+    return result;
+}
+
+// Method calls in tail position reuse the caller's frame like other calls.
+static bool invoke_from_class(Class* class, String* name, int arg_count, bool tail)
 {
     bool result = false;
     Value method;
     if (table_get(&class->methods, name, &method))
     {
-        result = call(as_closure(method), arg_count);
+        result = tail ? tail_call(as_closure(method), arg_count)
+                      : call(as_closure(method), arg_count);
     }
     else
     {
@@ -177,7 +263,48 @@ static bool invoke_from_class(Class* class, String* name, int arg_count)
     return result;
 }
 
-static bool invoke(String* name, int arg_count)
+// Inline caches belong to the chunk of the running function.
+static void cache_barrier(Inline_cache* cache)
+{
+    Object* function = (Object*)vm.frames[vm.frame_count - 1].closure->function;
+    write_barrier_object(function, (Object*)cache->shape);
+    write_barrier_object(function, (Object*)cache->method);
+    write_barrier_object(function, (Object*)cache->transition);
+}
+
+// Points cache at where name resolves for the receiver's shape. Only
+// called for instances that have a shape.
+static bool fill_cache(Instance* instance, String* name, Inline_cache* cache)
+{
+    bool found = true;
+    int slot = shape_find_slot(instance->shape, name);
+    Value method;
+    if (slot != -1)
+    {
+        cache->shape = instance->shape;
+        cache->slot = slot;
+        cache->method = NULL;
+    }
+    else if (table_get(&instance->class->methods, name, &method))
+    {
+        cache->shape = instance->shape;
+        cache->method = as_closure(method);
+    }
+    else
+    {
+        found = false;
+    }
+    cache_barrier(cache);
+    return found;
+}
+
+static bool is_cached(Instance* instance, String* name, Inline_cache* cache)
+{
+    return instance->shape != NULL
+        && (instance->shape == cache->shape || fill_cache(instance, name, cache));
+}
+
+static bool invoke(String* name, int arg_count, Inline_cache* cache, bool tail)
 {
     Value receiver = peek(arg_count);
     bool result = false;
@@ -185,14 +312,28 @@ static bool invoke(String* name, int arg_count)
     {
         Instance* instance = as_instance(receiver);
         Value value;
-        if (table_get(&instance->fields, name, &value))
+        if (is_cached(instance, name, cache))
+        {
+            if (cache->method != NULL)
+            {
+                result = tail ? tail_call(cache->method, arg_count)
+                              : call(cache->method, arg_count);
+            }
+            else
+            {
+                value = instance->fields[cache->slot];
+                vm.stack_top[-arg_count - 1] = value;
+                result = tail ? tail_call_value(value, arg_count) : call_value(value, arg_count);
+            }
+        }
+        else if (instance_get(instance, name, &value))
         {
             vm.stack_top[-arg_count - 1] = value;
-            result = call_value(value, arg_count);
+            result = tail ? tail_call_value(value, arg_count) : call_value(value, arg_count);
         }
         else
         {
-            result = invoke_from_class(instance->class, name, arg_count);
+            result = invoke_from_class(instance->class, name, arg_count, tail);
         }
     }
     else
@@ -250,22 +391,13 @@ static Upvalue* capture_upvalue(Value* local)
     return result;
 }
 
-static void close_upvalues(Value* last)
-{
-    while (vm.open_upvalues != NULL && vm.open_upvalues->location >= last)
-    {
-        Upvalue* upvalue = vm.open_upvalues;
-        upvalue->closed = *upvalue->location;
-        upvalue->location = &upvalue->closed;
-        vm.open_upvalues = upvalue->next;
-    }
-}
-
 static void define_method(String* name)
 {
     Value method = peek(0);
     Class* class = as_class(peek(1));
     table_set(&class->methods, name, method);
+    write_barrier((Object*)class, method);
+    write_barrier_object((Object*)class, (Object*)name);
     pop();
 }
 
@@ -281,430 +413,907 @@ static void reset_stack()
     vm.open_upvalues = NULL;
 }
 
-static Interpret_result unary_op(Op_code op)
-{
-    Interpret_result result = interpret_continue;
-    switch (op)
-    {
-    case op_negate:
-        if (!is_number(peek(0)))
-        {
-            runtime_error("Operand must be a number.");
-            result = interpret_runtime_error;
-        }
-        else
-        {
-            double val = -as_number(pop());
-            push(number_value(val));
-        }
-        break;
-    default:
-        break;
-    }
-    return result;
-}
-
-static Interpret_result binary_op_number(Op_code op)
+static bool concatenate()
 {
-    Interpret_result result = interpret_continue;
-    if (!is_number(peek(0)) || !is_number(peek(1)))
+    bool result = true;
+    String* b = as_string(peek(0));
+    String* a = as_string(peek(1));
+    if (a->length > INT_MAX - b->length)
     {
-        runtime_error("Operands must be numbers.");
-        result = interpret_runtime_error;
+        runtime_error("String too long.");
+        result = false;
     }
     else
     {
-        double b = as_number(pop());
-        double a = as_number(pop());
-        switch (op)
-        {
-        case op_add:
-            push(number_value(a + b));
-            break;
-        case op_subtract:
-            push(number_value(a - b));
-            break;
-        case op_multiply:
-            push(number_value(a * b));
-            break;
-        case op_divide:
-            push(number_value(a / b));
-            break;
-        case op_greater:
-            push(bool_value(a > b));
-            break;
-        case op_less:
-            push(bool_value(a < b));
-            break;
-        default:
-            break;
-        }
+        String* string = concatenate_strings(a, b);
+        pop();
+        pop();
+        push(object_value((Object*)string));
     }
     return result;
 }
 
-static void concatenate()
-{
-    String* b = as_string(peek(0));
-    String* a = as_string(peek(1));
-    int length = a->length + b->length;
-    char* chars = allocate_char(length + 1);
-    memcpy(chars, a->chars, a->length);
-    memcpy(chars + a->length, b->chars, b->length);
-    chars[length] = '\0';
-    String* result = take_string(chars, length);
-    pop();
-    pop();
-    push(object_value((Object*)result));
-}
-
-static Interpret_result add()
+static bool add()
 {
-    Interpret_result result = interpret_continue;
+    bool result = true;
     if (is_string(peek(0)) && is_string(peek(1)))
     {
-        concatenate();
+        result = concatenate();
     }
     else if (!is_number(peek(0)) || !is_number(peek(1)))
     {
         runtime_error("Operands must be two numbers or two strings.");
-        result = interpret_runtime_error;
+        result = false;
     }
     else
     {
-        result = binary_op_number(op_add);
+        double b = as_number(pop());
+        double a = as_number(pop());
+        push(number_value(a + b));
     }
     return result;
 }
 
+#ifdef DEBUG_TRACE_EXECUTION
+static void trace_execution(Call_frame* frame)
+{
+    printf("          ");
+    for (Value* slot = vm.stack; slot < vm.stack_top; slot++)
+    {
+        printf("[ ");
+        print_value(*slot);
+        printf(" ]");
+    }
+    printf("\n");
+    Chunk* chunk = &frame->closure->function->chunk;
+    disassemble_instruction(chunk, (int)(frame->ip - chunk->code));
+}
+#endif
+
+// The hot interpreter state lives in locals of run() so the compiler can
+// keep it in registers: the instruction pointer, the stack top, the current
+// frame's slots, its constant table and its inline caches. vm_save() writes
+// ip and the stack top back before anything that may inspect them (calls,
+// allocations that can trigger a collection, runtime errors); vm_load()
+// picks the state up again from the topmost frame afterwards.
+#define vm_save() (frame->ip = ip, vm.stack_top = sp)
+#define vm_load() \
+    (frame = &vm.frames[vm.frame_count - 1], \
+     ip = frame->ip, \
+     sp = vm.stack_top, \
+     slots = frame->slots, \
+     constants = frame->closure->function->chunk.constants.values, \
+     caches = frame->closure->function->chunk.caches)
+
+#define vm_read_byte() (*ip++)
+#define vm_read_short() (ip += 2, (uint16_t)((ip[-2] << 8) | ip[-1]))
+#define vm_read_constant() (constants[vm_read_byte()])
+#define vm_read_local() (slots[vm_read_byte()])
+#define vm_read_string() as_string(vm_read_constant())
+#define vm_read_cache() (ip += 2, &caches[(ip[-2] << 8) | ip[-1]])
+#define vm_push(value) (*sp++ = (value))
+#define vm_pop() (*--sp)
+#define vm_peek(distance) (sp[-1 - (distance)])
+
+// The interpreter loop is written once against these macros. With threaded
+// dispatch every handler jumps straight to the next one through a label
+// table, so each opcode gets its own indirect branch for the predictor to
+// learn. Otherwise it falls back to a portable switch inside a loop.
+#ifdef THREADED_DISPATCH
+#define vm_dispatch() goto *dispatch_table[vm_read_byte()];
+#define vm_case(op) op
+#ifdef DEBUG_TRACE_EXECUTION
+#define vm_next() \
+    do { vm_save(); trace_execution(frame); goto *dispatch_table[vm_read_byte()]; } while (false)
+#else
+#define vm_next() goto *dispatch_table[vm_read_byte()]
+#endif
+#else
+#define vm_dispatch() switch (vm_read_byte())
+#define vm_case(op) case op
+#define vm_next() continue
+#endif
+
+#define vm_error() do { result = interpret_runtime_error; goto done; } while (false)
+
+// Compiled functions are entered at the current instruction whenever control
+// arrives in a frame: after calls, returns and loop back-edges. Native code
+// returns here at the first instruction it leaves to the interpreter.
+#ifdef JIT
+#define vm_enter_jit() \
+    do \
+    { \
+        Function* function = frame->closure->function; \
+        if (function->jit != NULL) \
+        { \
+            vm_save(); \
+            function->jit->enter(frame, function->jit->entries[ip - function->chunk.code]); \
+            vm_load(); \
+        } \
+    } \
+    while (false)
+#else
+#define vm_enter_jit() ((void)0)
+#endif
+
+// Arithmetic and comparison sites quicken themselves: the first time a
+// generic instruction runs on two numbers it overwrites its own opcode with
+// the number-only form, which skips the type dispatch in add() and the
+// error path. A quickened instruction that meets anything but two numbers
+// restores the generic opcode and re-executes it.
+#define vm_quicken(op) (ip[-1] = (op))
+
+#define vm_number_op(make_value, operator) \
+    do \
+    { \
+        double b = as_number(vm_pop()); \
+        double a = as_number(vm_peek(0)); \
+        vm_peek(0) = make_value(a operator b); \
+    } \
+    while (false)
+
+#define vm_binary_op(make_value, operator, quickened) \
+    do \
+    { \
+        if (!is_number(vm_peek(0)) || !is_number(vm_peek(1))) \
+        { \
+            vm_save(); \
+            runtime_error("Operands must be numbers."); \
+            vm_error(); \
+        } \
+        vm_quicken(quickened); \
+        vm_number_op(make_value, operator); \
+    } \
+    while (false)
+
+// Register forms read their operands from the frame's slots and the
+// constant table, so an operator on locals is one dispatch rather than
+// three. Anything but two numbers is pushed and handled as by the stack
+// form, through fallback.
+#define vm_register_op(second, make_value, operator, fallback) \
+    do \
+    { \
+        Value a = vm_read_local(); \
+        Value b = (second); \
+        if (is_number(a) && is_number(b)) \
+        { \
+            vm_push(make_value(as_number(a) operator as_number(b))); \
+        } \
+        else \
+        { \
+            vm_push(a); \
+            vm_push(b); \
+            vm_save(); \
+            fallback; \
+        } \
+    } \
+    while (false)
+
+#define vm_operand_error() \
+    do { runtime_error("Operands must be numbers."); vm_error(); } while (false)
+#define vm_add_values() \
+    do { if (!add()) { vm_error(); } sp = vm.stack_top; } while (false)
+
 static Interpret_result run()
 {
-    Call_frame* frame = &vm.frames[vm.frame_count - 1];
-    Interpret_result result = interpret_continue;
-    while (result == interpret_continue)
+    Call_frame* frame;
+    uint8_t* ip;
+    Value* sp;
+    Value* slots;
+    Value* constants;
+    Inline_cache* caches;
+    vm_load();
+    Interpret_result result = interpret_ok;
+#ifdef THREADED_DISPATCH
+    static void* dispatch_table[] =
+    {
+        [op_constant] = &&op_constant,
+        [op_nil] = &&op_nil,
+        [op_true] = &&op_true,
+        [op_false] = &&op_false,
+        [op_negate] = &&op_negate,
+        [op_pop] = &&op_pop,
+        [op_get_local] = &&op_get_local,
+        [op_set_local] = &&op_set_local,
+        [op_get_upvalue] = &&op_get_upvalue,
+        [op_set_upvalue] = &&op_set_upvalue,
+        [op_close_upvalue] = &&op_close_upvalue,
+        [op_get_global] = &&op_get_global,
+        [op_define_global] = &&op_define_global,
+        [op_set_global] = &&op_set_global,
+        [op_get_property] = &&op_get_property,
+        [op_set_property] = &&op_set_property,
+        [op_get_super] = &&op_get_super,
+        [op_method] = &&op_method,
+        [op_equal] = &&op_equal,
+        [op_greater] = &&op_greater,
+        [op_less] = &&op_less,
+        [op_add] = &&op_add,
+        [op_subtract] = &&op_subtract,
+        [op_multiply] = &&op_multiply,
+        [op_divide] = &&op_divide,
+        [op_not] = &&op_not,
+        [op_print] = &&op_print,
+        [op_jump_if_false] = &&op_jump_if_false,
+        [op_jump] = &&op_jump,
+        [op_loop] = &&op_loop,
+        [op_call] = &&op_call,
+        [op_tail_call] = &&op_tail_call,
+        [op_invoke] = &&op_invoke,
+        [op_tail_invoke] = &&op_tail_invoke,
+        [op_super_invoke] = &&op_super_invoke,
+        [op_tail_super_invoke] = &&op_tail_super_invoke,
+        [op_closure] = &&op_closure,
+        [op_return] = &&op_return,
+        [op_class] = &&op_class,
+        [op_inherit] = &&op_inherit,
+        [op_equal_locals] = &&op_equal_locals,
+        [op_greater_locals] = &&op_greater_locals,
+        [op_less_locals] = &&op_less_locals,
+        [op_add_locals] = &&op_add_locals,
+        [op_subtract_locals] = &&op_subtract_locals,
+        [op_multiply_locals] = &&op_multiply_locals,
+        [op_divide_locals] = &&op_divide_locals,
+        [op_equal_constant] = &&op_equal_constant,
+        [op_greater_constant] = &&op_greater_constant,
+        [op_less_constant] = &&op_less_constant,
+        [op_add_constant] = &&op_add_constant,
+        [op_subtract_constant] = &&op_subtract_constant,
+        [op_multiply_constant] = &&op_multiply_constant,
+        [op_divide_constant] = &&op_divide_constant,
+        [op_pop_local] = &&op_pop_local,
+        [op_add_number] = &&op_add_number,
+        [op_subtract_number] = &&op_subtract_number,
+        [op_multiply_number] = &&op_multiply_number,
+        [op_divide_number] = &&op_divide_number,
+        [op_greater_number] = &&op_greater_number,
+        [op_less_number] = &&op_less_number
+    };
+#endif
+    for (;;)
     {
 #ifdef DEBUG_TRACE_EXECUTION
-        printf("          ");
-        for (Value* slot = vm.stack; slot < vm.stack_top; slot++)
-        {
-            printf("[ ");
-            print_value(*slot);
-            printf(" ]");
-        }
-        printf("\n");
-        Chunk* chunk = &frame->closure->function->chunk;
-        disassemble_instruction(chunk, (int)(frame->ip - chunk->code));
+        vm_save();
+        trace_execution(frame);
 #endif
-        uint8_t instruction = read_byte(frame);
-        switch (instruction)
+        vm_dispatch()
         {
-        case op_constant:
-            push(read_constant(frame));
-            break;
-        case op_nil:
-            push(nil_value());
-            break;
-        case op_true:
-            push(bool_value(true));
-            break;
-        case op_false:
-            push(bool_value(false));
-            break;
-        case op_pop:
-            pop();
-            break;
-        case op_get_local:
+        vm_case(op_constant):
+            vm_push(vm_read_constant());
+            vm_next();
+        vm_case(op_nil):
+            vm_push(nil_value());
+            vm_next();
+        vm_case(op_true):
+            vm_push(bool_value(true));
+            vm_next();
+        vm_case(op_false):
+            vm_push(bool_value(false));
+            vm_next();
+        vm_case(op_pop):
+            sp--;
+            vm_next();
+        vm_case(op_get_local):
         {
-            uint8_t slot = read_byte(frame);
-            push(frame->slots[slot]);
-            break;
+            uint8_t slot = vm_read_byte();
+            vm_push(slots[slot]);
+            vm_next();
         }
-        case op_set_local:
+        vm_case(op_set_local):
         {
-            uint8_t slot = read_byte(frame);
-            frame->slots[slot] = peek(0);
-            break;
+            uint8_t slot = vm_read_byte();
+            slots[slot] = vm_peek(0);
+            vm_next();
         }
-        case op_get_upvalue:
+        vm_case(op_get_upvalue):
         {
-            uint8_t slot = read_byte(frame);
-            push(*frame->closure->upvalues[slot]->location);
-            break;
+            uint8_t slot = vm_read_byte();
+            vm_push(*frame->closure->upvalues[slot]->location);
+            vm_next();
         }
-        case op_set_upvalue:
+        vm_case(op_set_upvalue):
         {
-            uint8_t slot = read_byte(frame);
-            *frame->closure->upvalues[slot]->location = peek(0);
-            break;
+            uint8_t slot = vm_read_byte();
+            Upvalue* upvalue = frame->closure->upvalues[slot];
+            *upvalue->location = vm_peek(0);
+            write_barrier((Object*)upvalue, vm_peek(0));
+            vm_next();
         }
-        case op_close_upvalue:
-            close_upvalues(vm.stack_top - 1);
-            pop();
-            break;
-        case op_get_global:
+        vm_case(op_close_upvalue):
+            close_upvalues(sp - 1);
+            sp--;
+            vm_next();
+        vm_case(op_get_global):
         {
-            String* name = read_string(frame);
-            Value value;
-            if (!table_get(&vm.globals, name, &value))
-            {
-                runtime_error("Undefined variable '%s'.", name->chars);
-                result = interpret_runtime_error;
-            }
-            else
+            uint16_t slot = vm_read_short();
+            Value value = vm.globals.values[slot];
+            if (is_undefined(value))
             {
-                push(value);
+                vm_save();
+                runtime_error("Undefined variable '%s'.", as_cstring(vm.global_names.values[slot]));
+                vm_error();
             }
-            break;
+            vm_push(value);
+            vm_next();
         }
-        case op_define_global:
+        vm_case(op_define_global):
         {
-            String* name = read_string(frame);
-            table_set(&vm.globals, name, peek(0));
-            pop();
-            break;
+            uint16_t slot = vm_read_short();
+            vm.globals.values[slot] = vm_pop();
+            vm_next();
         }
-        case op_set_global:
+        vm_case(op_set_global):
         {
-            String* name = read_string(frame);
-            bool is_new = table_set(&vm.globals, name, peek(0));
-            if (is_new)
+            uint16_t slot = vm_read_short();
+            if (is_undefined(vm.globals.values[slot]))
             {
-                table_delete(&vm.globals, name);
-                runtime_error("Undefined variable '%s'.", name->chars);
-                result = interpret_runtime_error;
+                vm_save();
+                runtime_error("Undefined variable '%s'.", as_cstring(vm.global_names.values[slot]));
+                vm_error();
             }
-            break;
+            vm.globals.values[slot] = vm_peek(0);
+            vm_next();
         }
-        case op_get_property:
+        vm_case(op_get_property):
         {
-            if (is_instance(peek(0)))
+            if (!is_instance(vm_peek(0)))
+            {
+                vm_save();
+                runtime_error("Only instances have properties.");
+                vm_error();
+            }
+            Instance* instance = as_instance(vm_peek(0));
+            String* name = vm_read_string();
+            Inline_cache* cache = vm_read_cache();
+            Value value;
+            if (!is_cached(instance, name, cache))
             {
-                Instance* instance = as_instance(peek(0));
-                String* name = read_string(frame);
-                Value value;
-                if (table_get(&instance->fields, name, &value))
+                vm_save();
+                if (instance_get(instance, name, &value))
                 {
-                    pop();
-                    push(value);
+                    vm_peek(0) = value;
                 }
                 else if (!bind_method(instance->class, name))
                 {
-                    result = interpret_runtime_error;
+                    vm_error();
                 }
             }
+            else if (cache->method == NULL)
+            {
+                vm_peek(0) = instance->fields[cache->slot];
+            }
             else
             {
-                runtime_error("Only instances have properties.");
-                result = interpret_runtime_error;
+                vm_save();
+                Bound_method* bound = new_bound_method(vm_peek(0), cache->method);
+                vm_peek(0) = object_value((Object*)bound);
             }
-            break;
+            vm_next();
         }
-        case op_set_property:
+        vm_case(op_set_property):
         {
-            if (is_instance(peek(1)))
+            if (!is_instance(vm_peek(1)))
             {
-                Instance* instance = as_instance(peek(1));
-                table_set(&instance->fields, read_string(frame), peek(0));
-                Value value = pop();
-                pop();
-                push(value);
+                vm_save();
+                runtime_error("Only instances have fields.");
+                vm_error();
+            }
+            Instance* instance = as_instance(vm_peek(1));
+            String* name = vm_read_string();
+            Inline_cache* cache = vm_read_cache();
+            if (instance->shape == NULL || instance->shape != cache->shape)
+            {
+                vm_save();
+                Shape* shape = instance->shape;
+                instance_set(instance, name, vm_peek(0));
+                if (shape != NULL && instance->shape != NULL)
+                {
+                    cache->shape = shape;
+                    cache->slot = shape_find_slot(instance->shape, name);
+                    cache->transition = shape != instance->shape ? instance->shape : NULL;
+                    cache_barrier(cache);
+                }
             }
             else
             {
-                runtime_error("Only instances have fields.");
-                result = interpret_runtime_error;
+                if (cache->transition != NULL)
+                {
+                    vm_save();
+                    instance_set_shape(instance, cache->transition);
+                }
+                instance->fields[cache->slot] = vm_peek(0);
+                write_barrier((Object*)instance, vm_peek(0));
             }
-            break;
+            Value value = vm_pop();
+            vm_peek(0) = value;
+            vm_next();
         }
-        case op_get_super:
+        vm_case(op_get_super):
         {
-            String* name = read_string(frame);
-            Class* superclass = as_class(pop());
+            String* name = vm_read_string();
+            Class* superclass = as_class(vm_pop());
+            vm_save();
             if (!bind_method(superclass, name))
             {
-                result = interpret_runtime_error;
+                vm_error();
             }
-            break;
+            sp = vm.stack_top;
+            vm_next();
         }
-        case op_method:
-            define_method(read_string(frame));
-            break;
-        case op_equal:
+        vm_case(op_method):
         {
-            Value b = pop();
-            Value a = pop();
-            push(bool_value(values_equal(a, b)));
-            break;
+            String* name = vm_read_string();
+            vm_save();
+            define_method(name);
+            sp = vm.stack_top;
+            vm_next();
         }
-        case op_negate:
-            result = unary_op(instruction);
-            break;
-        case op_add:
-            result = add();
-            break;
-        case op_greater:
-        case op_less:
-        case op_subtract:
-        case op_multiply:
-        case op_divide:
-            result = binary_op_number(instruction);
-            break;
-        case op_not:
-            push(bool_value(is_falsey(pop())));
-            break;
-        case op_print:
-            print_value(pop());
+        vm_case(op_equal):
+        {
+            Value b = vm_pop();
+            Value a = vm_peek(0);
+            vm_peek(0) = bool_value(values_equal(a, b));
+            vm_next();
+        }
+        vm_case(op_negate):
+            if (!is_number(vm_peek(0)))
+            {
+                vm_save();
+                runtime_error("Operand must be a number.");
+                vm_error();
+            }
+            vm_peek(0) = number_value(-as_number(vm_peek(0)));
+            vm_next();
+        vm_case(op_add):
+            if (is_number(vm_peek(0)) && is_number(vm_peek(1)))
+            {
+                vm_quicken(op_add_number);
+                vm_number_op(number_value, +);
+            }
+            else
+            {
+                vm_save();
+                if (!add())
+                {
+                    vm_error();
+                }
+                sp = vm.stack_top;
+            }
+            vm_next();
+        vm_case(op_greater):
+            vm_binary_op(bool_value, >, op_greater_number);
+            vm_next();
+        vm_case(op_less):
+            vm_binary_op(bool_value, <, op_less_number);
+            vm_next();
+        vm_case(op_subtract):
+            vm_binary_op(number_value, -, op_subtract_number);
+            vm_next();
+        vm_case(op_multiply):
+            vm_binary_op(number_value, *, op_multiply_number);
+            vm_next();
+        vm_case(op_divide):
+            vm_binary_op(number_value, /, op_divide_number);
+            vm_next();
+        vm_case(op_not):
+            vm_peek(0) = bool_value(is_falsey(vm_peek(0)));
+            vm_next();
+        vm_case(op_print):
+            print_value(vm_pop());
             printf("\n");
-            break;
-        case op_jump:
+            vm_next();
+        vm_case(op_jump):
         {
-            uint16_t offset = read_short(frame);
-            frame->ip += offset;
-            break;
+            uint16_t offset = vm_read_short();
+            ip += offset;
+            vm_next();
         }
-        case op_jump_if_false:
+        vm_case(op_jump_if_false):
         {
-            uint16_t offset = read_short(frame);
-            if (is_falsey(peek(0)))
+            uint16_t offset = vm_read_short();
+            if (is_falsey(vm_peek(0)))
             {
-                frame->ip += offset;
+                ip += offset;
             }
-            break;
+            vm_next();
         }
-        case op_loop:
+        vm_case(op_loop):
         {
-            uint16_t offset = read_short(frame);
-            frame->ip -= offset;
-            break;
+            uint16_t offset = vm_read_short();
+            ip -= offset;
+#ifdef JIT
+            heat(frame->closure->function);
+            vm_enter_jit();
+#endif
+            vm_next();
         }
-        case op_call:
+        vm_case(op_call):
         {
-            int arg_count = read_byte(frame);
-            if (!call_value(peek(arg_count), arg_count))
+            int arg_count = vm_read_byte();
+            vm_save();
+            if (!call_value(vm_peek(arg_count), arg_count))
             {
-                result = interpret_runtime_error;
+                vm_error();
             }
-            else
+            vm_load();
+            vm_enter_jit();
+            vm_next();
+        }
+        vm_case(op_tail_call):
+        {
+            int arg_count = vm_read_byte();
+            vm_save();
+            if (!tail_call_value(vm_peek(arg_count), arg_count))
             {
-                frame = &vm.frames[vm.frame_count - 1];
+                vm_error();
             }
-            break;
+            vm_load();
+            vm_enter_jit();
+            vm_next();
         }
-        case op_invoke:
+        vm_case(op_invoke):
         {
-            String* method = read_string(frame);
-            int arg_count = read_byte(frame);
-            if (!invoke(method, arg_count))
+            String* method = vm_read_string();
+            int arg_count = vm_read_byte();
+            Inline_cache* cache = vm_read_cache();
+            vm_save();
+            if (!invoke(method, arg_count, cache, false))
             {
-                result = interpret_runtime_error;
+                vm_error();
             }
-            else
+            vm_load();
+            vm_enter_jit();
+            vm_next();
+        }
+        vm_case(op_tail_invoke):
+        {
+            String* method = vm_read_string();
+            int arg_count = vm_read_byte();
+            Inline_cache* cache = vm_read_cache();
+            vm_save();
+            if (!invoke(method, arg_count, cache, true))
             {
-                frame = &vm.frames[vm.frame_count - 1];
+                vm_error();
             }
-            break;
+            vm_load();
+            vm_enter_jit();
+            vm_next();
         }
-        case op_super_invoke:
+        vm_case(op_super_invoke):
         {
-            String* method = read_string(frame);
-            int arg_count = read_byte(frame);
-            Class* superclass = as_class(pop());
-            if (!invoke_from_class(superclass, method, arg_count))
+            String* method = vm_read_string();
+            int arg_count = vm_read_byte();
+            Class* superclass = as_class(vm_pop());
+            vm_save();
+            if (!invoke_from_class(superclass, method, arg_count, false))
             {
-                result = interpret_runtime_error;
+                vm_error();
             }
-            else
+            vm_load();
+            vm_enter_jit();
+            vm_next();
+        }
+        vm_case(op_tail_super_invoke):
+        {
+            String* method = vm_read_string();
+            int arg_count = vm_read_byte();
+            Class* superclass = as_class(vm_pop());
+            vm_save();
+            if (!invoke_from_class(superclass, method, arg_count, true))
             {
-                frame = &vm.frames[vm.frame_count - 1];
+                vm_error();
             }
-            break;
+            vm_load();
+            vm_enter_jit();
+            vm_next();
         }
-        case op_closure:
+        vm_case(op_closure):
         {
-            Function* function = as_function(read_constant(frame));
+            Function* function = as_function(vm_read_constant());
+            vm_save();
             Closure* closure = new_closure(function);
-            push(object_value((Object*)closure));
+            vm_push(object_value((Object*)closure));
+            vm_save();
             for (int i = 0; i < closure->upvalue_count; i++)
             {
-                uint8_t is_local = read_byte(frame);
-                uint8_t index = read_byte(frame);
+                uint8_t is_local = vm_read_byte();
+                uint8_t index = vm_read_byte();
                 if (is_local)
                 {
-                    closure->upvalues[i] = capture_upvalue(frame->slots + index);
+                    closure->upvalues[i] = capture_upvalue(slots + index);
+                    write_barrier_object((Object*)closure, (Object*)closure->upvalues[i]);
                 }
                 else
                 {
                     closure->upvalues[i] = frame->closure->upvalues[index];
+                    write_barrier_object((Object*)closure, (Object*)closure->upvalues[i]);
                 }
             }
-            break;
+            vm_next();
         }
-        case op_return:
+        vm_case(op_return):
         {
-            Value val = pop();
-            close_upvalues(frame->slots);
+            Value val = vm_pop();
+            if (frame->closure->function->name == vm.init_string && is_instance(val))
+            {
+                note_initialized(as_instance(val));
+            }
+            close_upvalues(slots);
             vm.frame_count--;
             if (vm.frame_count == 0)
             {
-                pop();
-                result = interpret_ok;
+                vm.stack_top = sp - 1;
+                goto done;
             }
-            else
+            vm.stack_top = slots;
+            push(val);
+            vm_load();
+            vm_enter_jit();
+            vm_next();
+        }
+        vm_case(op_class):
+        {
+            String* name = vm_read_string();
+            vm_save();
+            vm_push(object_value((Object*)new_class(name)));
+            vm_next();
+        }
+        vm_case(op_inherit):
+        {
+            Value superclass = vm_peek(1);
+            if (!is_class(superclass))
             {
-                vm.stack_top = frame->slots;
-                push(val);
-                frame = &vm.frames[vm.frame_count - 1];
+                vm_save();
+                runtime_error("Superclass must be a class.");
+                vm_error();
             }
-            break;
+            Class* subclass = as_class(vm_peek(0));
+            vm_save();
+            table_add_all(&as_class(superclass)->methods, &subclass->methods);
+            write_barrier_table((Object*)subclass, &subclass->methods);
+            sp--;
+            vm_next();
         }
-        case op_class:
-            push(object_value((Object*)new_class(read_string(frame))));
-            break;
-        case op_inherit:
+        vm_case(op_equal_locals):
         {
-            Value superclass = peek(1);
-            if (is_class(superclass))
+            Value a = vm_read_local();
+            Value b = vm_read_local();
+            vm_push(bool_value(values_equal(a, b)));
+            vm_next();
+        }
+        vm_case(op_greater_locals):
+            vm_register_op(vm_read_local(), bool_value, >, vm_operand_error());
+            vm_next();
+        vm_case(op_less_locals):
+            vm_register_op(vm_read_local(), bool_value, <, vm_operand_error());
+            vm_next();
+        vm_case(op_add_locals):
+            vm_register_op(vm_read_local(), number_value, +, vm_add_values());
+            vm_next();
+        vm_case(op_subtract_locals):
+            vm_register_op(vm_read_local(), number_value, -, vm_operand_error());
+            vm_next();
+        vm_case(op_multiply_locals):
+            vm_register_op(vm_read_local(), number_value, *, vm_operand_error());
+            vm_next();
+        vm_case(op_divide_locals):
+            vm_register_op(vm_read_local(), number_value, /, vm_operand_error());
+            vm_next();
+        vm_case(op_equal_constant):
+        {
+            Value a = vm_read_local();
+            Value b = vm_read_constant();
+            vm_push(bool_value(values_equal(a, b)));
+            vm_next();
+        }
+        vm_case(op_greater_constant):
+            vm_register_op(vm_read_constant(), bool_value, >, vm_operand_error());
+            vm_next();
+        vm_case(op_less_constant):
+            vm_register_op(vm_read_constant(), bool_value, <, vm_operand_error());
+            vm_next();
+        vm_case(op_add_constant):
+            vm_register_op(vm_read_constant(), number_value, +, vm_add_values());
+            vm_next();
+        vm_case(op_subtract_constant):
+            vm_register_op(vm_read_constant(), number_value, -, vm_operand_error());
+            vm_next();
+        vm_case(op_multiply_constant):
+            vm_register_op(vm_read_constant(), number_value, *, vm_operand_error());
+            vm_next();
+        vm_case(op_divide_constant):
+            vm_register_op(vm_read_constant(), number_value, /, vm_operand_error());
+            vm_next();
+        vm_case(op_pop_local):
+        {
+            uint8_t slot = vm_read_byte();
+            slots[slot] = vm_pop();
+            vm_next();
+        }
+        vm_case(op_add_number):
+            if (is_number(vm_peek(0)) && is_number(vm_peek(1)))
             {
-                Class* subclass = as_class(peek(0));
-                table_add_all(&as_class(superclass)->methods, &subclass->methods);
-                pop();
+                vm_number_op(number_value, +);
             }
             else
             {
-                runtime_error("Superclass must be a class.");
-                result = interpret_runtime_error;
+                vm_quicken(op_add);
+                ip--;
             }
-            break;
-        }
-        default:
-            break;
+            vm_next();
+        vm_case(op_subtract_number):
+            if (is_number(vm_peek(0)) && is_number(vm_peek(1)))
+            {
+                vm_number_op(number_value, -);
+            }
+            else
+            {
+                vm_quicken(op_subtract);
+                ip--;
+            }
+            vm_next();
+        vm_case(op_multiply_number):
+            if (is_number(vm_peek(0)) && is_number(vm_peek(1)))
+            {
+                vm_number_op(number_value, *);
+            }
+            else
+            {
+                vm_quicken(op_multiply);
+                ip--;
+            }
+            vm_next();
+        vm_case(op_divide_number):
+            if (is_number(vm_peek(0)) && is_number(vm_peek(1)))
+            {
+                vm_number_op(number_value, /);
+            }
+            else
+            {
+                vm_quicken(op_divide);
+                ip--;
+            }
+            vm_next();
+        vm_case(op_greater_number):
+            if (is_number(vm_peek(0)) && is_number(vm_peek(1)))
+            {
+                vm_number_op(bool_value, >);
+            }
+            else
+            {
+                vm_quicken(op_greater);
+                ip--;
+            }
+            vm_next();
+        vm_case(op_less_number):
+            if (is_number(vm_peek(0)) && is_number(vm_peek(1)))
+            {
+                vm_number_op(bool_value, <);
+            }
+            else
+            {
+                vm_quicken(op_less);
+                ip--;
+            }
+            vm_next();
         }
     }
+done:
     return result;
 }
 
+#undef vm_save
+#undef vm_load
+#undef vm_read_byte
+#undef vm_read_short
+#undef vm_read_constant
+#undef vm_read_local
+#undef vm_read_string
+#undef vm_read_cache
+#undef vm_push
+#undef vm_pop
+#undef vm_peek
+#undef vm_dispatch
+#undef vm_case
+#undef vm_next
+#undef vm_error
+#undef vm_enter_jit
+#undef vm_quicken
+#undef vm_number_op
+#undef vm_binary_op
+#undef vm_register_op
+#undef vm_operand_error
+#undef vm_add_values
+
+void default_GC_settings(GC_settings* settings)
+{
+    settings->initial_heap = 1024 * 1024;
+    settings->heap_growth = 100;
+    settings->memory_limit = 0;
+    settings->pause_target = 0.0005;
+    settings->step_budget = 1024;
+#ifdef PARALLEL_GC
+    settings->workers = online_processors();
+#else
+    settings->workers = 1;
+#endif
+    settings->census = false;
+    settings->log = NULL;
+}
+
+// Pacing starts over from the initial heap size; a cycle that is running
+// finishes at its old pace.
+void configure_GC(const GC_settings* settings)
+{
+    vm.gc_settings = *settings;
+    vm.gc_budget = settings->step_budget;
+    vm.next_GC = settings->initial_heap;
+    vm.gc_goal = settings->initial_heap + settings->initial_heap / 100 * settings->heap_growth;
+    if (settings->memory_limit > 0 && vm.gc_goal > settings->memory_limit)
+    {
+        vm.gc_goal = settings->memory_limit;
+        vm.next_GC = settings->memory_limit / 2;
+    }
+#ifdef PARALLEL_GC
+    vm.gc_workers = settings->workers < 1 ? 1 : settings->workers;
+#endif
+}
+
 void init_VM()
 {
     reset_stack();
-    vm.objects = NULL;
+    vm.young_objects = NULL;
+    vm.remembered_count = 0;
+    vm.remembered_capacity = 0;
+    vm.remembered = NULL;
     vm.bytes_allocated = 0;
-    vm.next_GC = 1024ull * 1024ull;
-    init_table(&vm.globals);
+    vm.total_allocated = 0;
+    vm.next_minor_GC = 256ull * 1024ull;
+    vm.next_GC_step = 0;
+    vm.gc_runway = 0;
+    vm.gc_step_bytes = 8 * 1024;
+    vm.gc_work = 0;
+    vm.cycle_start = 0;
+    vm.gc_phase = gc_idle;
+    vm.minor_GC = false;
+    vm.sweep = NULL;
+    reset_GC_stats();
+    vm.hash_seed = random_seed();
+    GC_settings settings;
+    default_GC_settings(&settings);
+    configure_GC(&settings);
+    init_heap(&vm.heap);
+    init_table(&vm.global_slots);
+    init_value_array(&vm.global_names);
+    init_value_array(&vm.globals);
     init_table(&vm.strings);
     vm.init_string = NULL;
     vm.init_string = copy_string("init", 4);
     vm.gray_count = 0;
     vm.gray_capacity = 0;
     vm.gray_stack = NULL;
+#ifdef JIT
+    init_jit_arena(&vm.jit_arena);
+#endif
     define_native("clock", clock_native);
 }
 
 void free_VM()
 {
-    free_table(&vm.globals);
+    free_table(&vm.global_slots);
+    free_value_arrray(&vm.global_names);
+    free_value_arrray(&vm.globals);
     free_table(&vm.strings);
     vm.init_string = NULL;
     free_objects();
+    free_heap(&vm.heap);
+#ifdef JIT
+    free_jit_arena(&vm.jit_arena);
+#endif
+#ifdef PARALLEL_GC
+    free_markers();
+    free_sweeper();
+#endif
 }
 
 Interpret_result interpret(const char* source)
@@ -727,6 +1336,25 @@ Interpret_result interpret(const char* source)
     return result;
 }
 
+// Global variables live in vm.globals, indexed by a slot the compiler
+// resolves from the name once. A slot holds the undefined value until the
+// variable's declaration runs, so a function may refer to a global that is
+// only defined later.
+int resolve_global(String* name)
+{
+    Value slot;
+    if (!table_get(&vm.global_slots, name, &slot))
+    {
+        push(object_value((Object*)name));
+        slot = number_value(vm.globals.count);
+        write_value_array(&vm.global_names, object_value((Object*)name));
+        write_value_array(&vm.globals, undefined_value());
+        table_set(&vm.global_slots, name, slot);
+        pop();
+    }
+    return (int)as_number(slot);
+}
+
 void push(Value value)
 {
     *vm.stack_top = value;
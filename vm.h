@@ -1,9 +1,13 @@
 #ifndef clox_vm
 #define clox_vm
 
+#include <stdbool.h>
 #include <stdint.h>
+#include <stdio.h>
 
 #include "chunk.h"
+#include "heap.h"
+#include "jit.h"
 #include "object.h"
 #include "table.h"
 #include "value.h"
@@ -14,36 +18,126 @@ enum VM_parameter
     stack_max = frames_max * (UINT8_MAX + 1)
 };
 
-typedef struct
+typedef struct Call_frame
 {
     Closure* closure;
     uint8_t* ip;
     Value* slots;
 } Call_frame;
 
+typedef enum
+{
+    gc_idle,
+    gc_mark,
+    gc_sweep
+} GC_phase;
+
+// How the collector paces itself. A full cycle aims to be over by the time
+// the heap has grown heap_growth percent over what survived the last one,
+// never below initial_heap and, as far as the live data allows, not past
+// memory_limit (0 for none). The limit is soft: it never cuts the growth to
+// less than a quarter, and is ignored while the live data exceeds it, so a
+// heap that can't fit doesn't collect nonstop. Incremental steps do step_budget objects of
+// work, adjusted to take pause_target seconds when that is not 0; a
+// budget of 0 marks in a single pause. workers only counts with
+// PARALLEL_GC. With census on, each collection counts the objects it leaves
+// alive, which takes a walk over the heap. A log, when given, gets a line of
+// JSON per collection.
+typedef struct
+{
+    size_t initial_heap;
+    size_t heap_growth;
+    size_t memory_limit;
+    double pause_target;
+    size_t step_budget;
+    int workers;
+    bool census;
+    FILE* log;
+} GC_settings;
+
+// What one collection did, be it a full cycle or a minor collection. Times
+// are in seconds, start counting from init_VM(). Marking and sweeping add up
+// to the pauses, of which there are many in an incremental cycle. Bytes are
+// those the heap held when the collection started and ended, and those
+// allocated in between. live counts the surviving objects by type, the
+// whole heap's for a full cycle, the young generation's for a minor one,
+// and is only taken with a census.
+typedef struct
+{
+    bool full;
+    double start;
+    double mark_seconds;
+    double sweep_seconds;
+    double longest_pause;
+    int pauses;
+    size_t bytes_before;
+    size_t bytes_allocated;
+    size_t bytes_after;
+    size_t live[obj_type_count];
+} GC_record;
+
+typedef struct
+{
+    size_t full_cycles;
+    size_t minor_cycles;
+    double pause_seconds;
+    double longest_pause;
+    size_t bytes_reclaimed;
+    GC_record last;
+} GC_stats;
+
 typedef struct
 {
     Call_frame frames[frames_max];
     int frame_count;
     Value stack[stack_max];
     Value* stack_top;
-    Table globals;
+    Table global_slots;
+    Value_array global_names;
+    Value_array globals;
     Table strings;
+    uint64_t hash_seed;
     String* init_string;
     Upvalue* open_upvalues;
     size_t bytes_allocated;
+    size_t total_allocated;
     size_t next_GC;
-    Object* objects;
+    size_t next_minor_GC;
+    size_t next_GC_step;
+    GC_settings gc_settings;
+    size_t gc_goal;
+    size_t gc_runway;
+    size_t gc_step_bytes;
+    size_t gc_work;
+    size_t cycle_start;
+    size_t gc_budget;
+    GC_stats gc_stats;
+    GC_record gc_record;
+    bool gc_finished;
+    double gc_epoch;
+    GC_phase gc_phase;
+    bool minor_GC;
+    Page* sweep;
+    Object* young_objects;
+    int remembered_count;
+    int remembered_capacity;
+    Object** remembered;
     int gray_count;
     int gray_capacity;
     Object** gray_stack;
+    Heap heap;
+#ifdef JIT
+    Jit_arena jit_arena;
+#endif
+#ifdef PARALLEL_GC
+    int gc_workers;
+#endif
 } VM;
 
 extern VM vm;
 
 typedef enum
 {
-    interpret_continue,
     interpret_ok,
     interpret_compile_error,
     interpret_runtime_error
@@ -51,7 +145,10 @@ typedef enum
 
 void init_VM();
 void free_VM();
+void default_GC_settings(GC_settings* settings);
+void configure_GC(const GC_settings* settings);
 Interpret_result interpret(const char* source);
+int resolve_global(String* name);
 void push(Value value);
 Value pop();
 